@@ -1,5 +1,53 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <cstring>          // memcmp, strcmp
+#include <vector>           // vector
+#include <deque>            // deque
+#include <functional>       // function
+#include <thread>           // thread
+#include <mutex>            // mutex
+#include <condition_variable> // condition_variable
+#include <map>              // map
+#include <memory>           // unique_ptr
+#include <algorithm>        // max
+#include <string>           // string
+#include <cstddef>          // offsetof
+#include <cmath>            // powf
+#include <unordered_map>    // unordered_map
+#include <atomic>           // atomic
+#include <cstdint>          // uint64_t
+#include <climits>          // INT_MAX
+#include <cfloat>           // FLT_MAX
+#include <cstdio>           // rename, remove
+#include <fstream>          // ifstream, ofstream
+
+// SSE2 is part of every x64 target; 32-bit builds opt in with /arch:SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define U_USE_SSE2
+#include <emmintrin.h>      // SSE2 intrinsics
+#include <tmmintrin.h>      // SSSE3 intrinsics, only called after a runtime check
+#ifdef _MSC_VER
+#include <intrin.h>         // __cpuid
+#define U_TARGET_SSSE3
+#else
+#define U_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+// File mapping for the on-disk caches
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>        // CreateFileMapping, MapViewOfFile, MoveFileEx
+#include <direct.h>         // _mkdir
+#else
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat, mkdir
+#include <fcntl.h>          // open
+#include <unistd.h>         // close
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 
@@ -23,11 +71,248 @@ using namespace std; // Standard namespace
 namespace
 {
     const char* const WINDOW_TITLE = "Project - Rayyan Abdulmunib"; // Macro for window title
+    // Seconds between updates of the statistics shown after the window title
+    const float WINDOW_TITLE_INTERVAL = 0.5f;
 
     // Variables for window width and height
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Materials the scene is drawn with, one texture each
+    enum MaterialId
+    {
+        MATERIAL_GLASS,     // Hemisphere and torus
+        MATERIAL_GRAY,      // Plane
+        MATERIAL_WOOD,      // Rolling pin and eggs
+        MATERIAL_COUNT
+    };
+    // Materials drawn blended; their colors are premultiplied and their back faces show through
+    const unsigned int TRANSLUCENT_MATERIALS = 1u << MATERIAL_GLASS;
+    // Materials whose objects cast shadows: glass lets the light through, and nothing lies under the plane
+    const unsigned int SHADOW_CASTER_MATERIALS = ((1u << MATERIAL_COUNT) - 1) & ~TRANSLUCENT_MATERIALS & ~(1u << MATERIAL_GRAY);
+
+    // Interleaved vertex layout: x, y, z, nx, ny, nz, s, t
+    const GLuint VERTEX_FLOATS = 8;
+
+    // LRU cache size the triangle reordering optimizes for, and FIFO size used to measure the result
+    const size_t FORSYTH_CACHE_SIZE = 32;
+    const GLuint VERTEX_CACHE_SIZE = 16;
+
+    // Largest layer of the material texture array; layers are square powers of two
+    const int TEXTURE_ARRAY_MAX_SIZE = 1024;
+    // Most layers in the material texture array; the size of uLayerMinLod in the fragment shader
+    const int TEXTURE_ARRAY_MAX_LAYERS = 8;
+    // Texture levels uploaded per frame at most; the first one goes through whatever its size
+    const size_t TEXTURE_UPLOAD_BYTES_PER_FRAME = 2 * 1024 * 1024;
+    // Color of texture array layers that have not been decoded yet
+    const unsigned char TEXTURE_PLACEHOLDER_COLOR[4] = { 128, 128, 128, 255 };
+    // Lowest PSNR in dB the --check-textures run accepts from the block encoder
+    const float TEXTURE_MIN_PSNR = 35.0f;
+
+    // Directory of the preprocessed files, relative to the working directory like the textures
+    const char* const CACHE_DIRECTORY = "../../resources/cache/";
+    // Identifies the texture cache container; bump the version whenever its layout or contents change
+    const char TEXTURE_CACHE_MAGIC[8] = { 'U', 'T', 'E', 'X', 'C', 'A', 'C', 'H' };
+    const uint32_t TEXTURE_CACHE_VERSION = 4;
+    // Identifies the mesh cache file; bump the version whenever generation or post-processing changes
+    const char MESH_CACHE_MAGIC[8] = { 'U', 'M', 'E', 'S', 'H', 'C', 'A', 'C' };
+    const uint32_t MESH_CACHE_VERSION = 4;
+    // Identifies the program binary cache files; the binaries themselves are versioned by the driver
+    const char PROGRAM_CACHE_MAGIC[8] = { 'U', 'P', 'R', 'O', 'G', 'C', 'A', 'C' };
+    const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+    // 64-bit FNV-1a, used to key the cache files by their sources
+    const uint64_t FNV64_OFFSET_BASIS = 14695981039346656037ull;
+    const uint64_t FNV64_PRIME = 1099511628211ull;
+
+    // Tessellation levels per curved primitive; each level halves the stacks and sectors of the previous one
+    const GLuint LOD_LEVEL_COUNT = 4;
+    const unsigned int LOD_MIN_STACKS = 4;
+    const unsigned int LOD_MIN_SECTORS = 8;
+    // Longest on-screen edge, in pixels, a silhouette may have before a finer level is picked
+    const float LOD_MAX_EDGE_PIXELS = 8.0f;
+    // Fraction the edge length must move past the limit before a level changes, against popping
+    const float LOD_HYSTERESIS = 0.25f;
+
+    // Largest cluster the meshlet builder makes, in vertices and triangles
+    const GLuint MESHLET_MAX_VERTICES = 64;
+    const GLuint MESHLET_MAX_TRIANGLES = 124;
+    // Clusters whose triangle normals spread wider than this cosine from their average are never cone culled
+    const float MESHLET_MIN_CONE_COSINE = 0.1f;
+
+    // Grid the vertex attributes are snapped to when looking for duplicates
+    const float WELD_EPSILON = 1e-5f;
+    // Texture coordinates a seam needs at one position; a position with more along a single texture axis is a
+    // ring collapsed into a pole, while one spread along both is a corner where two seams meet
+    const GLuint WELD_SEAM_TEXTURE_COORDINATES = 2;
+    // Triangles whose corner angle has a smaller sine than this have no area to draw
+    const float DEGENERATE_SINE = 1e-5f;
+
+    // Procedural primitives UCreateMesh knows how to generate
+    enum PrimitiveType
+    {
+        PRIMITIVE_HEMISPHERE,
+        PRIMITIVE_TORUS,
+        PRIMITIVE_PLANE,
+        PRIMITIVE_CYLINDER,
+        PRIMITIVE_EGG,
+        PRIMITIVE_CAP
+    };
+
+    // Generator parameters of one primitive
+    struct PrimitiveDesc
+    {
+        PrimitiveType type;
+        unsigned int stacks;    // Rings along the primitive (unused by the plane and caps)
+        unsigned int sectors;   // Segments around the primitive (unused by the plane)
+        float radius;           // Hemisphere, tube, cylinder, egg or cap radius; half size of the plane
+        float length;           // Torus ring radius or cylinder height
+        glm::vec3 scale;        // Egg shape
+    };
+
+    // sin/cos of 2*PI*j/sectors for j = 0..sectors, shared by every primitive with that sector count
+    struct SinCosTable
+    {
+        std::vector<float> cosines;
+        std::vector<float> sines;
+        std::vector<float> u;       // j / sectors, the s texture coordinate around the ring
+    };
+    std::map<unsigned int, std::unique_ptr<SinCosTable>> gSinCosTables;
+    std::mutex gSinCosTablesMutex;  // Generation jobs look tables up concurrently
+
+    // One stack of a parametric surface: position = center + axisU * cos(sector) + axisV * sin(sector),
+    // and the normal follows the same form before normalization
+    struct SurfaceRing
+    {
+        glm::vec3 center;
+        glm::vec3 axisU;
+        glm::vec3 axisV;
+        glm::vec3 normalCenter;
+        glm::vec3 normalU;
+        glm::vec3 normalV;
+    };
+
+    // Range of the shared vertex and index buffers occupied by one primitive
+    struct GLSubMesh
+    {
+        GLuint firstIndex;  // Offset of the first index, in indices
+        GLuint indexCount;  // Number of indices of the primitive
+        GLint baseVertex;   // Offset of the first vertex; indices are local to the primitive
+        GLuint vertexCount; // Number of vertices of the primitive
+        glm::vec3 boundsMin;    // Object-space bounding box
+        glm::vec3 boundsMax;
+        GLuint firstMeshlet;    // Clusters of the primitive; none when the mesh was not processed on the CPU
+        GLuint meshletCount;
+    };
+
+    // Run of consecutive triangles of a submesh, culled as a unit against the frustum and the view direction
+    struct GLMeshlet
+    {
+        GLuint firstIndex;      // Offset of the first index, in indices, like GLSubMesh::firstIndex
+        GLuint indexCount;
+        glm::vec3 center;       // Object-space bounding sphere
+        float radius;
+        glm::vec3 coneAxis;     // Average facing of the triangles
+        float coneCutoff;       // Sine of the widest angle between a triangle and the axis; 1 is never culled
+    };
+
+    // Quantized vertex layout, 16 bytes instead of 32
+    struct CompactVertex
+    {
+        GLshort position[4];    // snorm16 relative to the submesh bounds; w is padding
+        GLshort normal[2];      // snorm16 octahedral-encoded normal
+        GLushort texCoord[2];   // unorm16 texture coordinates
+    };
+
+    // Vertex attributes snapped to the welding grid
+    struct WeldKey
+    {
+        GLint q[VERTEX_FLOATS];
+
+        bool operator==(const WeldKey& other) const
+        {
+            return memcmp(q, other.q, sizeof(q)) == 0;
+        }
+    };
+
+    // FNV-1a over the snapped attributes
+    struct WeldKeyHash
+    {
+        size_t operator()(const WeldKey& key) const
+        {
+            const unsigned char* bytes = (const unsigned char*)key.q;
+            GLuint hash = 2166136261u;
+            for (size_t i = 0; i < sizeof(key.q); ++i)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash;
+        }
+    };
+
+    // std430 mirror of DrawData in the vertex shader, one per submesh
+    struct GLDrawData
+    {
+        glm::vec4 boundsCenter; // Dequantizes compact positions: position * extent + center
+        glm::vec4 boundsExtent;
+        glm::mat4 model;        // World matrix of the object's scene node
+        glm::mat4 normalMatrix; // transpose(inverse(mat3(model))), padded to a mat4
+        GLuint material;        // MaterialId of the instance
+        GLuint padding[3];
+    };
+    static_assert(sizeof(GLDrawData) == 176, "GLDrawData must match the std430 layout");
+
+    // Destination of a buffer's contents while they are being written
+    struct BufferWriter
+    {
+        GLenum target;
+        GLuint buffer;
+        GLsizeiptr size;
+        bool mapped;                // Writing through a mapping of the buffer itself
+        bool immutable;             // Immutable storage was allocated for the buffer
+        std::vector<char> staging;  // Written instead when the buffer could not be mapped
+    };
+
+    // Layout of a glMultiDrawElementsIndirect command
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // Tessellation levels of one library mesh, stored as consecutive submeshes from finest to coarsest
+    struct GLLodChain
+    {
+        GLuint firstSubMesh;
+        GLuint levelCount;
+        GLuint levelSectors[LOD_LEVEL_COUNT];   // Segments around the silhouette at each level
+        glm::vec3 boundsMin;                    // Object-space bounding box
+        glm::vec3 boundsMax;
+        bool closed;                            // Watertight surface, whose back faces are always hidden
+    };
+
+    // One placed copy of a library mesh
+    struct GLInstance
+    {
+        GLuint chain;           // Library mesh drawn by the instance
+        GLuint node;            // Scene node placing the instance
+        MaterialId material;
+        GLuint level;           // Level of detail drawn this frame
+        bool visible;           // Inside the view frustum this frame
+        bool clustered;         // Drawn as its surviving meshlets this frame rather than as an instance
+    };
+
+    // World-space bounding spheres split by component, so four are tested per SIMD instruction;
+    // padded to a multiple of four
+    struct GLCullSpheres
+    {
+        std::vector<float> x;
+        std::vector<float> y;
+        std::vector<float> z;
+        std::vector<float> radius;
+    };
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
@@ -36,21 +321,484 @@ namespace
         GLuint nVertices;    // Number of indices of the mesh
         GLuint nIndices;
         GLuint ebo;
+        GLuint indirectBuffer;              // Handle for the draw indirect buffer
+        GLuint drawIdBuffer;                // Per-instance attribute holding each instance's draw data index
+        GLuint drawDataBuffer;              // Shader storage buffer of GLDrawData
+        bool compactVertices;               // Vertices are CompactVertex and indices 16-bit
+        GLenum indexType;                   // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        std::vector<GLSubMesh> subMeshes;   // Draw range of every primitive, in generation order
+        std::vector<GLMeshlet> meshlets;    // Clusters of every submesh, in submesh order
+        std::vector<GLLodChain> lodChains;  // Library of shared meshes, one per primitive
+        std::vector<GLInstance> instances;  // Every object of the scene
+        std::vector<DrawElementsIndirectCommand> commands;  // CPU copy of the indirect buffer
+        GLuint commandCapacity;             // Commands the indirect buffer has room for
+        GLuint shadowIndirectBuffer;        // Commands drawing every shadow caster, whatever the view
+        std::vector<DrawElementsIndirectCommand> shadowCommands;    // CPU copy of the shadow indirect buffer
+        std::vector<DrawElementsIndirectCommand> meshletCommands;   // Surviving meshlet ranges of the clustered
+                                                                    // instances, baseInstance holding the instance
+        std::vector<GLuint> instanceIds;    // CPU copy of the drawId buffer: visible instances in command order
+        std::vector<GLDrawData> drawData;   // CPU copy of the draw data buffer, one per instance
+        std::vector<GLuint> bucketStart;    // Scratch of UUpdateDrawCommands, kept so frames do not allocate
+        std::vector<GLuint> bucketFill;
+        std::vector<GLuint> nextInstanceIds;
+        std::vector<DrawElementsIndirectCommand> nextCommands;
+        GLCullSpheres cullSpheres;          // Per-instance culling volumes, refreshed when an instance moves
+        GLuint culledObjects;               // Instances outside the frustum in the last frame, shown in the window title
+        GLuint culledMeshlets;              // Clusters of the clustered instances skipped in the last frame,
+        GLuint testedMeshlets;              // out of those tested, shown in the window title
+        GLuint culledMeshletTriangles;
+        GLuint testedMeshletTriangles;
+    };
+
+    // Transform hierarchy as parallel arrays; parents always precede their children, so a single
+    // forward pass propagates every change and walks each array linearly
+    struct SceneGraph
+    {
+        std::vector<GLint> parent;              // -1 for roots
+        std::vector<glm::mat4> local;           // Transform relative to the parent
+        std::vector<glm::mat4> world;
+        std::vector<unsigned char> dirty;       // Local transform edited since the last update
+        std::vector<unsigned char> changed;     // World transform recomputed by the last update
+        bool hasDirtyNodes;
+        bool hasChangedNodes;
+    };
+
+    // Jobs are waited for per group, so a long running group does not hold up the others
+    enum JobGroup
+    {
+        JOB_GROUP_DEFAULT,
+        JOB_GROUP_TEXTURES, // Texture decoding, polled by the render loop instead of waited for
+        JOB_GROUP_COUNT
+    };
+
+    // Fixed set of worker threads that run queued jobs
+    class ThreadPool
+    {
+    public:
+        ThreadPool() : stopping(false)
+        {
+            for (int group = 0; group < JOB_GROUP_COUNT; ++group)
+                pending[group] = 0;
+        }
+        ~ThreadPool() { Stop(); }
+
+        // Spawns the worker threads; a pool with no workers runs jobs inline
+        void Start(unsigned int threadCount)
+        {
+            for (unsigned int i = 0; i < threadCount; ++i)
+                workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+        }
+
+        // Finishes the queued jobs and joins the worker threads
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            jobAvailable.notify_all();
+            for (size_t i = 0; i < workers.size(); ++i)
+                workers[i].join();
+            workers.clear();
+            stopping = false;
+        }
+
+        void Submit(std::function<void()> job, JobGroup group = JOB_GROUP_DEFAULT)
+        {
+            if (workers.empty())
+            {
+                job();
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(Job(std::move(job), group));
+                ++pending[group];
+            }
+            jobAvailable.notify_one();
+        }
+
+        // Blocks until every job submitted to the group has finished
+        void Wait(JobGroup group = JOB_GROUP_DEFAULT)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobsDone.wait(lock, [this, group]() { return pending[group] == 0; });
+        }
+
+    private:
+        typedef std::pair<std::function<void()>, JobGroup> Job;
+
+        void WorkerLoop()
+        {
+            for (;;)
+            {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    jobAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                    if (jobs.empty())
+                        return;
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                job.first();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending[job.second] == 0)
+                    jobsDone.notify_all();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::deque<Job> jobs;
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        std::condition_variable jobsDone;
+        unsigned int pending[JOB_GROUP_COUNT];
+        bool stopping;
+    };
+
+    // Image processing steps of the texture loader; USelectImageKernels picks the widest
+    // implementation the CPU supports
+    typedef void (*ExpandToRGBAKernel)(const unsigned char* source, int channels, unsigned char* destination, size_t pixelCount);
+    typedef void (*PremultiplyAlphaKernel)(unsigned char* pixels, size_t pixelCount);
+    typedef void (*DownsampleKernel)(const unsigned char* source, int sourceSize, unsigned char* destination);
+    struct ImageKernels
+    {
+        ExpandToRGBAKernel expandToRGBA;            // Grey, grey alpha or RGB to RGBA
+        PremultiplyAlphaKernel premultiplyAlpha;    // RGBA in place
+        DownsampleKernel downsample;                // 2x2 box filter of a square RGBA image
+        const char* name;
+    };
+
+    // Read-only view of a whole file
+    struct MappedFile
+    {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // Header of a texture cache file, followed by the mip chain of one texture from the largest level
+    // to 1x1, stored flipped for OpenGL and tightly packed
+    struct TextureCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t format;        // Internal format of every level
+        uint32_t size;          // Width and height of level 0
+        uint32_t levelCount;
+        uint32_t translucent;   // Source has alpha below 255, so its array needs BC3
+        uint32_t reserved;
+        uint64_t sourceHash;
+        uint64_t dataSize;      // Bytes of level data after the header
+    };
+
+    // Header of the mesh cache file, followed by the submesh table, the meshlet table, the vertex buffer
+    // and the index buffer exactly as UCreateMesh uploads them
+    struct MeshCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t compactVertices;   // Vertex and index formats of the buffers
+        uint64_t parameterHash;     // UHashMeshParameters of the primitives and toggles that made them
+        uint32_t subMeshCount;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t meshletCount;
+        uint64_t vertexBytes;
+        uint64_t indexBytes;
+    };
+
+    // Header of a program binary cache file, followed by the binary glGetProgramBinary returned
+    struct ProgramCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t binaryFormat;  // Driver-specific format of the binary
+        uint64_t sourceHash;    // Vertex and fragment sources of the variant, defines included
+        uint64_t driverHash;    // UHashDriver of the driver that linked it
+        uint64_t binarySize;
+    };
+
+    // Decoding state of a layer of a streamed texture array
+    enum TextureLayerState
+    {
+        TEXTURE_LAYER_DECODING,
+        TEXTURE_LAYER_DECODED,  // Pixels are in the upload buffer, waiting for the GL thread
+        TEXTURE_LAYER_CACHED,   // Same, copied from the texture cache instead of decoded
+        TEXTURE_LAYER_FAILED,
+        TEXTURE_LAYER_MISSING,  // Failure reported, the layer keeps its placeholder
+        TEXTURE_LAYER_STREAMING // Levels uploaded and evicted by residency, from the upload buffer or the cache file
+    };
+
+    // Texture array whose layers are decoded on the thread pool and streamed in by the render loop,
+    // coarsest levels first; layers show a placeholder color until then. Each layer keeps the levels
+    // its objects need on screen, within gTextureBudgetBytes
+    struct TextureArrayLoad
+    {
+        GLuint texture;
+        GLuint pixelBuffer;                 // Persistently mapped unpack buffer holding every layer's mip chain,
+                                            // released once the layers are uploaded as far as they are wanted
+        unsigned char* pixels;              // Mapping of pixelBuffer, or staging when it could not be mapped
+        std::vector<unsigned char> staging;
+        std::vector<MappedFile> cacheFiles; // Cache file of each layer, mapped when the upload buffer is released
+                                            // to upload evicted levels again
+        bool keepUploadBuffer;              // A layer has no cache file, so the upload buffer stays
+        std::vector<std::string> filenames;
+        std::unique_ptr<std::atomic<int>[]> layerStates;
+        int layerCount;
+        unsigned int premultipliedLayers;   // Bit per layer whose colors are multiplied by alpha
+        unsigned int translucentLayers;     // Bit per layer whose source has alpha below 255
+        std::vector<uint64_t> layerHashes;  // Hash of each layer's source and load parameters
+        std::vector<std::string> cachePaths; // Texture cache file of each layer, named after its hash
+        int size;                           // Width and height of every layer
+        int levelCount;
+        GLenum format;                      // GL_RGBA8, or a BC1/BC3 format when the layers are compressed
+        size_t layerBytes;                  // Mip chain of one layer
+        std::vector<size_t> levelOffsets;   // Offset of each level within a layer's mip chain
+        std::vector<int> residentLevels;    // Finest level uploaded per layer; levelCount before any
+        std::vector<int> wantedLevels;      // Finest level per layer the visible objects need, within the budget
+        std::vector<float> minLods;         // Finest level sampled per layer, mirrored by uLayerMinLod
+        std::vector<float> diameters;       // Largest visible object per layer in pixels, reused every frame
+        size_t residentBytes;               // Uploaded levels of every layer
+        size_t loggedResidentBytes;
+        bool sparse;                        // Levels before the mip tail are committed and released page by page
+        GLint sparseLevels;                 // Levels before the mip tail
+        std::vector<float> layerPSNR;       // Quality of the compressed layers encoded this run, 0 otherwise
+        int pendingLayers;
+        double startTime;
     };
 
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
+    // Toggle for the quantized vertex format and 16-bit indices
+    bool gCompactVertices = true;
+    // Toggle for the vertex cache and vertex fetch reordering pass
+    bool gOptimizeVertexCache = true;
+    // Toggle for the vertex welding and degenerate triangle removal pass
+    bool gWeldVertices = true;
+    // Toggle for the binary cache of the processed mesh buffers
+    bool gCacheMeshes = true;
+    // Toggle for the per-frame culling of the meshlets of dense submeshes
+    bool gCullMeshlets = true;
+    // Toggle for the on-disk cache of linked shader programs
+    bool gCacheShaderPrograms = true;
+    // Toggle for the shadow maps of the key light and spotlight
+    bool gShadows = true;
+    // Toggle for BC1/BC3 block compressed textures
+    bool gCompressTextures = true;
+    // Video memory the material texture levels may keep resident
+    size_t gTextureBudgetBytes = 32 * 1024 * 1024;
+    // Worker threads for startup jobs such as mesh generation
+    ThreadPool gThreadPool;
     // Triangle mesh data
     GLMesh gMesh;
-    // Texture id
+    // Placement of every object in the mesh
+    SceneGraph gScene;
+    // Texture array holding one layer per MaterialId
     GLuint gTextureId;
-    // Shader program
+    // Background decoding of the material textures
+    TextureArrayLoad gTextureLoad;
+    // Image processing used by the texture loader
+    ImageKernels gImageKernels;
+    // Uniform locations resolved once when the shader program links
+    struct GLUniforms
+    {
+        GLint uTexture;     // Location of the texture sampler
+        GLint uLayerMinLod; // Location of the per layer level clamp
+        GLint uClusterParams;   // Location of the froxel grid mapping
+        GLint uShadowMap;       // Location of the shadow map sampler
+        GLint uShadowViewProjection;    // Location of the light's matrix in the shadow pass
+    };
+
+    // Compile-time switches of the shaders; every combination in use is linked as a program of its own,
+    // with a #define per feature set to 0 or 1
+    enum ShaderFeature
+    {
+        SHADER_COMPACT_VERTICES = 1 << 0,   // CompactVertex input, dequantized in the vertex shader
+        SHADER_KEY_LIGHT = 1 << 1,
+        SHADER_FILL_LIGHT = 1 << 2,
+        SHADER_SPOTLIGHT = 1 << 3,
+        SHADER_SPOT_ATTENUATION = 1 << 4,   // Spotlight fades with distance
+        SHADER_CLUSTERED_LIGHTS = 1 << 5,   // Local lights, looked up through the fragment's cluster
+        SHADER_SHADOWS = 1 << 6,            // Key light and spotlight occluded through their shadow maps
+        SHADER_SHADOW_PASS = 1 << 7,        // Depth only, from the light's point of view
+        SHADER_FEATURE_COUNT = 8
+    };
+    // Names of the #defines, in bit order
+    const char* const SHADER_FEATURE_DEFINES[SHADER_FEATURE_COUNT] = {
+        "COMPACT_VERTICES", "KEY_LIGHT", "FILL_LIGHT", "SPOTLIGHT", "SPOT_ATTENUATION", "CLUSTERED_LIGHTS",
+        "SHADOWS", "SHADOW_PASS"
+    };
+
+    // Linked shader program for one feature mask
+    struct ShaderVariant
+    {
+        GLuint programId;   // 0 when the variant failed to build, so it is not tried again
+        GLUniforms uniforms;
+    };
+
+    // Variants built so far, keyed by feature mask
+    std::map<unsigned int, ShaderVariant> gShaderVariants;
+    // Shader program in use and its uniform locations
     GLuint gProgramId;
+    GLUniforms gUniforms;
+
+    // Uniform block binding points shared by all shader programs
+    const GLuint LIGHT_BLOCK_BINDING = 0;
+    const GLuint CAMERA_BLOCK_BINDING = 1;
+    const GLuint DRAW_DATA_BINDING = 2;     // Shader storage binding of the per-draw data
+    const GLuint LOCAL_LIGHT_BINDING = 3;   // Shader storage bindings of the clustered lighting
+    const GLuint CLUSTER_BINDING = 4;
+    const GLuint CLUSTER_LIGHT_BINDING = 5;
+
+    // Clip planes of both projections, shared with the depth slices of the light clusters
+    const float CLIP_NEAR = 0.1f;
+    const float CLIP_FAR = 100.0f;
+    // Speed in units per second and farthest distance of the rolling pin the R and F keys move
+    const float ROLLING_PIN_SPEED = 0.5f;
+    const float ROLLING_PIN_RANGE = 0.5f;
+    // Froxel grid of the clustered lighting: screen tiles by exponential depth slices. Rows are tested
+    // four clusters at a time, so the width stays a multiple of four
+    const GLuint CLUSTER_GRID_X = 16;
+    const GLuint CLUSTER_GRID_Y = 12;
+    const GLuint CLUSTER_GRID_Z = 24;
+    const GLuint CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+    static_assert(CLUSTER_GRID_X % 4 == 0, "Cluster rows are tested in groups of four");
+
+    // Layers of the shadow map array, one per shadowed light
+    enum ShadowLayer
+    {
+        SHADOW_LAYER_SPOTLIGHT,
+        SHADOW_LAYER_KEY_LIGHT,
+        SHADOW_LAYER_COUNT
+    };
+    // Width and height of each shadow map, and the texture unit the array is sampled from
+    const GLsizei SHADOW_MAP_SIZE = 2048;
+    const GLuint SHADOW_TEXTURE_UNIT = 1;
+    // Polygon offset of the shadow pass: slope-scaled and constant depth bias against self-shadowing
+    const float SHADOW_SLOPE_BIAS = 2.0f;
+    const float SHADOW_CONSTANT_BIAS = 4.0f;
+    // Widens the light frustums past what they must cover, so the filter taps at the edges stay inside the map
+    const float SHADOW_CONE_MARGIN = 1.05f;
+    // Shadow frustums keep at least this ratio between their near and far planes, for depth precision
+    const float SHADOW_MIN_NEAR_RATIO = 0.001f;
+    // Widest half angle of a shadow frustum, which the key light's falls back to when it is among its casters
+    const float SHADOW_MAX_HALF_ANGLE = glm::radians(60.0f);
+
+    // std140 mirror of the PointLight struct in the shaders
+    struct PointLight
+    {
+        glm::vec3 position;
+        float intensity;
+        glm::vec3 color;
+        float padding;
+    };
 
-    GLuint gHemTor;
-    GLuint gPlane;
-    GLuint gRollPin;
-    GLuint gEggs;
+    // std140 mirror of the Spotlight struct in the shaders
+    struct Spotlight
+    {
+        glm::vec3 position;
+        float intensity;
+        glm::vec3 direction;
+        float cutOff;
+        glm::vec3 color;
+        float outerCutOff;
+        float constant;
+        float linear;
+        float quadratic;
+        float padding;
+    };
+
+    // std140 mirror of the LightBlock uniform block
+    struct LightBlock
+    {
+        PointLight keyLight;
+        PointLight fillLight;
+        Spotlight spotlight;
+        glm::mat4 spotShadowMatrix; // World to shadow map texture coordinates and depth, per shadowed light
+        glm::mat4 keyShadowMatrix;
+    };
+    static_assert(sizeof(LightBlock) == 256, "LightBlock must match the std140 layout");
+
+    // std140 mirror of the CameraBlock uniform block
+    struct CameraBlock
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::mat4 viewProjection;
+        glm::vec3 viewPos;
+        float padding;
+    };
+    static_assert(sizeof(CameraBlock) == 208, "CameraBlock must match the std140 layout");
+
+    // Uniform buffers and the CPU copies of what was last uploaded to them
+    GLuint gLightUbo;
+    GLuint gCameraUbo;
+    LightBlock gLightBlock;
+    CameraBlock gCameraBlock;
+    bool gLightsDirty = true;   // Set whenever gLightBlock is edited
+    bool gCameraValid = false;  // False until the first camera upload
+
+    // std430 mirror of the LocalLight struct in the fragment shader. Light fades out completely at its
+    // range; point lights keep cosines below -1, so every direction is inside their cone
+    struct LocalLight
+    {
+        glm::vec3 position;
+        float range;
+        glm::vec3 color;            // Premultiplied by the intensity
+        float outerCutOff;          // Cosine of the outer cone angle
+        glm::vec3 direction;        // Unit vector the spotlight points along
+        float cutOff;               // Cosine of the inner cone angle
+    };
+    static_assert(sizeof(LocalLight) == 48, "LocalLight must match the std430 layout");
+
+    // Local lights and their assignment to the froxels of the view, redone on the CPU every frame
+    struct ClusteredLights
+    {
+        std::vector<LocalLight> lights;
+        bool lightsDirty;                   // Set whenever lights is edited
+        GLuint lightBuffer;                 // Shader storage buffers of the lights,
+        GLuint clusterBuffer;               // of the (offset, count) range of every cluster
+        GLuint indexBuffer;                 // and of the light indices the ranges point into
+        size_t lightCapacity;               // Lights and indices the buffers have room for
+        size_t indexCapacity;
+        glm::mat4 boundsProjection;         // Projection the cluster bounds were computed for
+        bool boundsValid;
+        // View-space bounding boxes of the clusters split by component, so four are tested per SIMD instruction
+        std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+        std::vector<GLuint> clusterRanges;  // CPU copies of clusterBuffer
+        std::vector<GLuint> lightIndices;   // and indexBuffer
+        std::vector<GLuint> pairClusters;   // Scratch (cluster, light) pairs of UAssignLightsToClusters,
+        std::vector<GLuint> pairLights;     // kept so frames do not allocate
+        size_t loggedLightCount;
+    };
+    ClusteredLights gClusteredLights;
+    // Depth maps of the shadowed lights. They are only re-rendered when a light they were rendered for or a
+    // shadow caster changes, so a still scene pays for the lookups but not for a depth pass
+    struct ShadowMaps
+    {
+        GLuint texture;             // Depth texture array, one layer per ShadowLayer; 0 when shadows are off
+        GLuint framebuffer;         // Depth-only framebuffer the layers are attached to in turn
+        PointLight keyLight;        // Lights the maps were last rendered for
+        Spotlight spotlight;
+        bool valid;                 // The maps were rendered at least once
+        GLuint renderCount;
+    };
+    ShadowMaps gShadowMaps;
+    // Local lights UCreateLocalLights scatters over the counter; the L key cycles through a few counts
+    unsigned int gLocalLightCount = 0;
+    // Rolling pin the R and F keys roll away from the eggs and back; only its subtree of the scene
+    // graph is updated while it moves
+    struct RollingPin
+    {
+        GLuint node;
+        glm::mat4 placement;    // Local transform at rest
+        float radius;           // Rolls without slipping on its body's radius
+        float distance;         // How far it has rolled, 0 to ROLLING_PIN_RANGE
+    };
+    RollingPin gRollingPin;
 
     // Camera
     Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -76,35 +824,174 @@ void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
+void UCreateMesh(GLMesh& mesh, SceneGraph& scene);
+void UCountPrimitive(const PrimitiveDesc& primitive, GLuint& vertexCount, GLuint& indexCount);
+void UGeneratePrimitive(const PrimitiveDesc& primitive, float* vertices, GLuint* indices);
+void UGeneratePrimitives(const std::vector<PrimitiveDesc>& primitives, const std::vector<GLSubMesh>& subMeshes, float* vertices, GLuint* indices);
+uint64_t UHashMeshParameters(const std::vector<PrimitiveDesc>& primitives);
+bool UOpenMeshCache(const std::string& path, uint64_t parameterHash, size_t subMeshCount, MappedFile& file);
+void UComputePrimitiveBounds(const PrimitiveDesc& primitive, glm::vec3& boundsMin, glm::vec3& boundsMax);
+void UEncodeOctahedral(const glm::vec3& normal, GLshort* encoded);
+void UEncodeCompactMesh(const std::vector<GLSubMesh>& subMeshes, const float* vertices, const GLuint* indices,
+    CompactVertex* compactVertices, GLushort* compactIndices);
+void* UBeginBufferWrite(BufferWriter& writer, GLenum target, GLuint buffer, GLsizeiptr size, bool useBufferStorage);
+bool UEndBufferWrite(BufferWriter& writer);
+void UWeldSubMesh(float* vertices, GLuint* indices, GLuint& vertexCount, GLuint& indexCount);
+void UWeldMesh(std::vector<GLSubMesh>& subMeshes, std::vector<float>& vertices, std::vector<GLuint>& indices);
+float UForsythVertexScore(int cachePosition, GLuint remainingTriangles);
+void UOptimizeVertexCache(GLuint* indices, GLuint indexCount, GLuint vertexCount);
+void UOptimizeVertexFetch(float* vertices, GLuint* indices, GLuint indexCount, GLuint vertexCount);
+GLuint USimulateVertexCache(const GLuint* indices, GLuint indexCount, GLuint vertexCount);
+void UOptimizeMesh(const std::vector<GLSubMesh>& subMeshes, float* vertices, GLuint* indices);
+void UBuildSubMeshMeshlets(const GLSubMesh& subMesh, const float* vertices, const GLuint* indices, std::vector<GLMeshlet>& meshlets);
+void UComputeMeshletBounds(const float* vertices, const GLuint* indices, GLMeshlet& meshlet);
+void UBuildMeshlets(std::vector<GLSubMesh>& subMeshes, const float* vertices, const GLuint* indices, std::vector<GLMeshlet>& meshlets);
+std::string UInjectDefines(const char* source, const std::string& defines);
+float* UWriteVertex(float* vertex, const glm::vec3& position, const glm::vec3& normal, float s, float t);
+GLuint* UWriteGridIndices(GLuint* index, unsigned int stacks, unsigned int sectors);
+const SinCosTable& UGetSinCosTable(unsigned int sectors);
+void UEvaluateRing(const SurfaceRing& ring, const SinCosTable& table, unsigned int count, float t, float* vertex);
 void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
+void USelectLevelsOfDetail(GLMesh& mesh, const glm::mat4& view, const glm::mat4& projection);
+void UExtractFrustumPlanes(const glm::mat4& view, const glm::mat4& projection, glm::vec4* planes);
+void UCullObjects(GLMesh& mesh, const SceneGraph& scene, const glm::mat4& view, const glm::mat4& projection);
+void UCullMeshlets(GLMesh& mesh, const SceneGraph& scene, const glm::mat4& view, const glm::mat4& projection);
+void UUpdateDrawCommands(GLMesh& mesh);
+void UUpdateObjectTransforms(GLMesh& mesh, const SceneGraph& scene);
+GLuint UAddSceneNode(SceneGraph& scene, GLint parent, const glm::mat4& local);
+void USetLocalTransform(SceneGraph& scene, GLuint node, const glm::mat4& local);
+void UUpdateWorldTransforms(SceneGraph& scene);
+bool UBeginTextureArrayLoad(TextureArrayLoad& load, const char* const* filenames, int layerCount, unsigned int premultipliedLayers, GLuint& textureId);
+void UPollTextureArrayLoad(TextureArrayLoad& load);
+void UEndTextureArrayLoad(TextureArrayLoad& load);
+bool UValidTextureCacheFile(const TextureArrayLoad& load, int layer, const MappedFile& file);
+bool UMapTextureCacheFiles(TextureArrayLoad& load);
+void UReleaseTextureUploadBuffer(TextureArrayLoad& load);
+void UUpdateTextureResidency(TextureArrayLoad& load, const GLMesh& mesh, const glm::mat4& view, const glm::mat4& projection);
+void UUploadTextureLevel(TextureArrayLoad& load, int layer, int level);
+void UEvictTextureLevel(TextureArrayLoad& load, int layer);
+bool UEvictUnwantedTextureLevels(TextureArrayLoad& load, size_t bytesNeeded);
+void UResampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, unsigned char* destination, int size);
+void UBuildMipChain(unsigned char* pixels, int size, int levelCount);
+size_t UTextureLevelBytes(GLenum format, int size);
+void UUnpackColor565(unsigned int color, int* rgb);
+void UColorPalette(unsigned int color0, unsigned int color1, int palette[4][3]);
+void UAlphaPalette(int alpha0, int alpha1, int palette[8]);
+void UEncodeColorBlock(const unsigned char* pixels, unsigned char* block);
+void UEncodeAlphaBlock(const unsigned char* pixels, unsigned char* block);
+void UCompressImage(const unsigned char* pixels, int size, GLenum format, unsigned char* destination);
+void UDecompressImage(const unsigned char* blocks, int size, GLenum format, unsigned char* destination);
+float UMeasurePSNR(const unsigned char* reference, const unsigned char* pixels, size_t pixelCount, int channels);
+void USelectImageKernels();
+void UExpandToRGBAScalar(const unsigned char* source, int channels, unsigned char* destination, size_t pixelCount);
+void UPremultiplyAlphaScalar(unsigned char* pixels, size_t pixelCount);
+void UDownsampleScalar(const unsigned char* source, int sourceSize, unsigned char* destination);
+#ifdef U_USE_SSE2
+void UExpandToRGBASSSE3(const unsigned char* source, int channels, unsigned char* destination, size_t pixelCount);
+void UPremultiplyAlphaSSE2(unsigned char* pixels, size_t pixelCount);
+void UDownsampleSSE2(const unsigned char* source, int sourceSize, unsigned char* destination);
+#endif
+bool UProbeTextureLayer(TextureArrayLoad& load, int layer, bool& translucent);
+bool ULoadTextureLayer(TextureArrayLoad& load, int layer, unsigned char* destination, bool& cacheHit);
+bool UHasTranslucentAlpha(const unsigned char* pixels, size_t pixelCount, int channels);
+bool UCheckTextureCompression(const char* const* filenames, int count);
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash);
+bool UReadFile(const std::string& path, std::vector<unsigned char>& contents);
+bool UWriteCacheFile(const std::string& path, const void* header, size_t headerSize, const void* data, size_t dataSize);
+bool UMapFile(const std::string& path, MappedFile& file);
+void UUnmapFile(MappedFile& file);
+void UCreateCacheDirectory();
 void UDestroyTexture(GLuint textureId);
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+void UUpdateWindowTitle(GLFWwindow* window, const GLMesh& mesh);
+bool UCreateShaderProgram(unsigned int features, GLuint& programId, GLUniforms& uniforms);
+bool UCompileShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint programId);
+bool UProgramBinariesSupported();
+uint64_t UHashDriver();
+bool ULoadProgramBinary(const std::string& path, uint64_t sourceHash, uint64_t driverHash, GLuint programId);
+void USaveProgramBinary(const std::string& path, uint64_t sourceHash, uint64_t driverHash, GLuint programId);
 void UDestroyShaderProgram(GLuint programId);
+unsigned int USelectShaderFeatures(const GLMesh& mesh, const LightBlock& lights, const ClusteredLights& clustered, const ShadowMaps& shadows);
+bool UUseShaderVariant(unsigned int features);
+void UDestroyShaderVariants();
+void UCreateUniformBuffers();
+void UDestroyUniformBuffers();
+void UUpdateUniformBuffers(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos);
+void UCreateClusteredLights(ClusteredLights& clustered);
+void UDestroyClusteredLights(ClusteredLights& clustered);
+void UCreateLocalLights(ClusteredLights& clustered, unsigned int count);
+void UComputeClusterBounds(ClusteredLights& clustered, const glm::mat4& projection);
+void UAssignLightsToClusters(ClusteredLights& clustered, const glm::mat4& view, const glm::mat4& projection);
+void UCreateShadowMaps(ShadowMaps& shadows);
+void UDestroyShadowMaps(ShadowMaps& shadows);
+glm::mat4 ULightViewProjection(const glm::vec3& position, const glm::vec3& direction, float halfAngle,
+    const glm::vec3& sceneCenter, float sceneRadius);
+void UUpdateShadowMaps(ShadowMaps& shadows, const GLMesh& mesh, const SceneGraph& scene);
 
 
 /* Vertex Shader Source Code*/
 const GLchar* vertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position;
-    layout(location = 1) in vec3 normal; // Assuming normal vectors are provided here
+    layout(location = 1) in vec3 normal;        // Octahedral-encoded in .xy with COMPACT_VERTICES
     layout(location = 2) in vec2 textureCoordinate;
+    layout(location = 3) in uint drawId;        // Instance index, read from the visible instance list
 
     out vec2 vertexTextureCoordinate;
     out vec3 FragPos;
     out vec3 Normal;
+    flat out uint vertexMaterial;   // Texture array layer
+
+    layout(std140, binding = 1) uniform CameraBlock
+    {
+        mat4 view;
+        mat4 projection;
+        mat4 viewProjection;    // projection * view, computed on the CPU
+        vec3 viewPos;
+    };
+
+    struct DrawData
+    {
+        vec4 boundsCenter;
+        vec4 boundsExtent;
+        mat4 model;
+        mat4 normalMatrix;      // transpose(inverse(mat3(model))), computed on the CPU
+        uint material;
+    };
+
+    layout(std430, binding = 2) readonly buffer DrawBlock
+    {
+        DrawData draws[];
+    };
+
+    uniform mat4 uShadowViewProjection; // Light the shadow pass renders for, replacing the camera
 
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    // Inverse of UEncodeOctahedral
+    vec3 octDecode(vec2 e)
+    {
+        vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+        float t = max(-n.z, 0.0);
+        n.x += n.x >= 0.0 ? -t : t;
+        n.y += n.y >= 0.0 ? -t : t;
+        return normalize(n);
+    }
 
     void main() 
     {
-        FragPos = vec3(model * vec4(position, 1.0f));
-        Normal = mat3(transpose(inverse(model))) * normal; // Transform normals
+        // COMPACT_VERTICES is a compile-time constant, so only one side of each branch is compiled in
+        vec3 localPosition = position;
+        vec3 localNormal = normal;
+        if (COMPACT_VERTICES != 0)
+        {
+            localPosition = position * draws[drawId].boundsExtent.xyz + draws[drawId].boundsCenter.xyz;
+            localNormal = octDecode(normal.xy);
+        }
+
+        vec4 worldPosition = draws[drawId].model * vec4(localPosition, 1.0f);
+        FragPos = worldPosition.xyz;
+        Normal = mat3(draws[drawId].normalMatrix) * localNormal; // Transform normals
         vertexTextureCoordinate = textureCoordinate;
-        gl_Position = projection * view * model * vec4(position, 1.0f);
+        vertexMaterial = draws[drawId].material;
+        gl_Position = (SHADOW_PASS != 0 ? uShadowViewProjection : viewProjection) * worldPosition;
     }
 );
 
@@ -115,83 +1002,199 @@ const GLchar* fragmentShaderSource = GLSL(440,
     in vec2 vertexTextureCoordinate;
     in vec3 FragPos;
     in vec3 Normal;
+    flat in uint vertexMaterial;
 
     out vec4 fragmentColor;
 
-    uniform sampler2D uTexture;
-    uniform vec3 keyLightPos;
-    uniform vec3 fillLightPos;
-    uniform vec3 viewPos; // Make sure you actually use or remove this if it's not needed
-    uniform vec3 keyLightColor;
-    uniform vec3 fillLightColor;
-    uniform float keyLightIntensity;
-    uniform float fillLightIntensity;
+    uniform sampler2DArray uTexture;    // One layer per material
+    uniform float uLayerMinLod[TEXTURE_ARRAY_MAX_LAYERS]; // Finest resident level of each layer
 
-    struct Spotlight {
+    struct PointLight {
         vec3 position;
-        vec3 direction;
+        float intensity;
         vec3 color;
+    };
+
+    struct Spotlight {
+        vec3 position;
         float intensity;
+        vec3 direction;
         float cutOff;
+        vec3 color;
         float outerCutOff;
         float constant;
         float linear;
         float quadratic;
     };
 
-    uniform Spotlight spotlight;
+    // Member order matches LightBlock on the CPU side (std140)
+    layout(std140, binding = 0) uniform LightBlock
+    {
+        PointLight keyLight;
+        PointLight fillLight;
+        Spotlight spotlight;
+        mat4 spotShadowMatrix;
+        mat4 keyShadowMatrix;
+    };
+
+    layout(std140, binding = 1) uniform CameraBlock
+    {
+        mat4 view;
+        mat4 projection;
+        mat4 viewProjection;
+        vec3 viewPos;
+    };
+
+    struct LocalLight {
+        vec3 position;
+        float range;
+        vec3 color;
+        float outerCutOff;
+        vec3 direction;
+        float cutOff;
+    };
+
+    layout(std430, binding = 3) readonly buffer LocalLightBlock
+    {
+        LocalLight localLights[];
+    };
+
+    // Offset and count of each cluster's lights in clusterLights
+    layout(std430, binding = 4) readonly buffer ClusterBlock
+    {
+        uvec2 clusters[];
+    };
+
+    layout(std430, binding = 5) readonly buffer ClusterLightBlock
+    {
+        uint clusterLights[];
+    };
+
+    uniform vec4 uClusterParams;    // Tile width and height in pixels, near plane, depth slices per unit of log depth
+
+    uniform sampler2DArrayShadow uShadowMap;    // Caster depth, one layer per shadowed light
+
+    // Fraction of a light reaching the fragment, over a 3x3 block of its shadow map; every tap is itself
+    // a bilinear blend of four depth comparisons, so the shadow edges are smoothed over four texels
+    float shadowFactor(mat4 shadowMatrix, float layer)
+    {
+        vec4 shadowPosition = shadowMatrix * vec4(FragPos, 1.0);
+        vec3 coords = shadowPosition.xyz / shadowPosition.w;
+        // Nothing outside the light's frustum was rendered, so nothing there can occlude it
+        if (shadowPosition.w <= 0.0 || any(greaterThan(abs(coords - 0.5), vec3(0.5))))
+            return 1.0;
+
+        vec2 texelSize = 1.0 / vec2(textureSize(uShadowMap, 0).xy);
+        float lit = 0.0;
+        for (int y = -1; y <= 1; ++y)
+        {
+            for (int x = -1; x <= 1; ++x)
+                lit += texture(uShadowMap, vec4(coords.xy + vec2(x, y) * texelSize, layer, coords.z));
+        }
+        return lit / 9.0;
+    }
 
     void main() {
-        vec3 objectColor = texture(uTexture, vertexTextureCoordinate).rgb; // Use texture color
+        // The shadow pass only writes depth
+        if (SHADOW_PASS != 0)
+        {
+            fragmentColor = vec4(0.0);
+            return;
+        }
 
-        // Ambient
+        // Never samples the levels of the layer that are not streamed in
+        float lod = max(textureQueryLod(uTexture, vertexTextureCoordinate).y, uLayerMinLod[vertexMaterial]);
+        vec3 objectColor = textureLod(uTexture, vec3(vertexTextureCoordinate, float(vertexMaterial)), lod).rgb; // Use texture color
+
+        // Ambient; lights that are switched off still tint it
         float ambientStrength = 0.1;
-        vec3 ambient = ambientStrength * (keyLightColor + fillLightColor);
+        vec3 lighting = ambientStrength * (keyLight.color + fillLight.color);
 
         // Normals
         vec3 norm = normalize(Normal);
 
+        // The light switches are compile-time constants, so a variant carries no math for the lights it leaves out
+
         // Key Light Calculations
-        vec3 keyLightDir = normalize(keyLightPos - FragPos);
-        float keyDiff = max(dot(norm, keyLightDir), 0.0);
-        vec3 keyDiffuse = keyDiff * keyLightColor * keyLightIntensity;
+        if (KEY_LIGHT != 0)
+        {
+            vec3 keyLightDir = normalize(keyLight.position - FragPos);
+            float keyDiff = max(dot(norm, keyLightDir), 0.0);
+            if (SHADOWS != 0)
+                keyDiff *= shadowFactor(keyShadowMatrix, SHADOW_LAYER_KEY_LIGHT);
+            lighting += keyDiff * keyLight.color * keyLight.intensity;
+        }
 
         // Fill Light Calculations
-        vec3 fillLightDir = normalize(fillLightPos - FragPos);
-        float fillDiff = max(dot(norm, fillLightDir), 0.0);
-        vec3 fillDiffuse = fillDiff * fillLightColor * fillLightIntensity;
+        if (FILL_LIGHT != 0)
+        {
+            vec3 fillLightDir = normalize(fillLight.position - FragPos);
+            float fillDiff = max(dot(norm, fillLightDir), 0.0);
+            lighting += fillDiff * fillLight.color * fillLight.intensity;
+        }
 
         // Spotlight calculation
-        vec3 lightDir = normalize(spotlight.position - FragPos);
-        float theta = dot(lightDir, normalize(-spotlight.direction));
-        float epsilon = spotlight.cutOff - spotlight.outerCutOff;
-        float intensity = clamp((theta - spotlight.outerCutOff) / epsilon, 0.0, 1.0);
-        float distance = length(spotlight.position - FragPos);
-        float attenuation = 1.0 / (spotlight.constant + spotlight.linear * distance + spotlight.quadratic * (distance * distance));
-        vec3 spotlightEffect = attenuation * intensity * spotlight.color * spotlight.intensity;
+        if (SPOTLIGHT != 0)
+        {
+            vec3 lightDir = normalize(spotlight.position - FragPos);
+            float theta = dot(lightDir, normalize(-spotlight.direction));
+            float epsilon = spotlight.cutOff - spotlight.outerCutOff;
+            float intensity = clamp((theta - spotlight.outerCutOff) / epsilon, 0.0, 1.0);
+            float attenuation = 1.0 / spotlight.constant;
+            if (SPOT_ATTENUATION != 0)
+            {
+                float distance = length(spotlight.position - FragPos);
+                attenuation = 1.0 / (spotlight.constant + spotlight.linear * distance + spotlight.quadratic * (distance * distance));
+            }
+            if (SHADOWS != 0)
+                intensity *= shadowFactor(spotShadowMatrix, SHADOW_LAYER_SPOTLIGHT);
+            lighting += attenuation * intensity * spotlight.color * spotlight.intensity;
+        }
+
+        // Local lights: only the ones whose range reaches this fragment's cluster are visited
+        if (CLUSTERED_LIGHTS != 0)
+        {
+            uvec2 tile = min(uvec2(gl_FragCoord.xy / uClusterParams.xy), uvec2(CLUSTER_GRID_X - 1u, CLUSTER_GRID_Y - 1u));
+            float depth = max(-(view * vec4(FragPos, 1.0)).z, uClusterParams.z);
+            uint slice = uint(clamp(int(log(depth / uClusterParams.z) * uClusterParams.w), 0, int(CLUSTER_GRID_Z) - 1));
+            uvec2 range = clusters[tile.x + CLUSTER_GRID_X * (tile.y + CLUSTER_GRID_Y * slice)];
+            for (uint i = 0u; i < range.y; ++i)
+            {
+                LocalLight light = localLights[clusterLights[range.x + i]];
+                vec3 toLight = light.position - FragPos;
+                float distance = length(toLight);
+                vec3 localLightDir = toLight / max(distance, 0.0001);
+                // Inverse square falloff, windowed to reach zero at the range
+                float window = clamp(1.0 - pow(distance / light.range, 4.0), 0.0, 1.0);
+                float falloff = window * window / (distance * distance + 1.0);
+                float cone = clamp((dot(-localLightDir, light.direction) - light.outerCutOff) / (light.cutOff - light.outerCutOff), 0.0, 1.0);
+                lighting += max(dot(norm, localLightDir), 0.0) * falloff * cone * light.color;
+            }
+        }
 
         // Combine the lighting components
-        vec3 result = (ambient + keyDiffuse + fillDiffuse + spotlightEffect) * objectColor;
+        vec3 result = lighting * objectColor;
         fragmentColor = vec4(result, 1.0); // Set the final color
     }
 );
 
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it.
+// Rows are swapped in blocks through a small buffer, so the copies run at memcpy speed
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
+    const size_t rowBytes = size_t(width) * channels;
+    unsigned char block[1024];
     for (int j = 0; j < height / 2; ++j)
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
-
-        for (int i = width * channels; i > 0; --i)
+        unsigned char* row1 = image + j * rowBytes;
+        unsigned char* row2 = image + (height - 1 - j) * rowBytes;
+        for (size_t offset = 0; offset < rowBytes; offset += sizeof(block))
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            const size_t count = std::min(sizeof(block), rowBytes - offset);
+            memcpy(block, row1 + offset, count);
+            memcpy(row1 + offset, row2 + offset, count);
+            memcpy(row2 + offset, block, count);
         }
     }
 }
@@ -199,50 +1202,51 @@ void flipImageVertically(unsigned char* image, int width, int height, int channe
 // Main function
 int main(int argc, char* argv[])
 {
+    const char* textureFilenames[MATERIAL_COUNT] = {
+        "../../resources/textures/glass.png",
+        "../../resources/textures/gray.png",
+        "../../resources/textures/wood.png"
+    };
+
+    // Checks the texture compression on the CPU alone, without a window
+    if (argc > 1 && strcmp(argv[1], "--check-textures") == 0)
+    {
+        USelectImageKernels();
+        return UCheckTextureCompression(textureFilenames, MATERIAL_COUNT) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
-    // Creates the mesh
-    UCreateMesh(gMesh); 
+    // One worker per core; the main thread keeps the GL context
+    gThreadPool.Start(std::thread::hardware_concurrency());
+    USelectImageKernels();
 
-    // Creates the shader program
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
+    // Starts decoding the material textures into one array, indexed by MaterialId; the layers
+    // arrive while the mesh and shaders are built, or during the first frames
+    // Glass is blended, so its colors are premultiplied to keep translucent texels from bleeding into its mipmaps
+    if (!UBeginTextureArrayLoad(gTextureLoad, textureFilenames, MATERIAL_COUNT, TRANSLUCENT_MATERIALS, gTextureId))
         return EXIT_FAILURE;
 
-    // Loads glass texture
-    const char* glassTexFilename = "../../resources/textures/glass.png";
-    if (!UCreateTexture(glassTexFilename, gHemTor))
-    {
-        cout << "Failed to load texture " << glassTexFilename << endl;
-        return EXIT_FAILURE;
-    }
+    // Creates the mesh
+    UCreateMesh(gMesh, gScene); 
 
-    // Loads gray texture
-    const char* grayTexFilename = "../../resources/textures/gray.png";
-    if (!UCreateTexture(grayTexFilename, gPlane))
-    {
-        cout << "Failed to load texture " << grayTexFilename << endl;
-        return EXIT_FAILURE;
-    }
+    // Creates the light and camera uniform buffers, the buffers of the clustered local lights and the shadow maps
+    UCreateUniformBuffers();
+    UCreateClusteredLights(gClusteredLights);
+    UCreateShadowMaps(gShadowMaps);
 
-    // Loads wood texture
-    const char* woodTexFilename = "../../resources/textures/wood.png";
-    if (!UCreateTexture(woodTexFilename, gRollPin))
-    {
-        cout << "Failed to load texture " << glassTexFilename << endl;
+    // Builds the shader variant for the vertex format the mesh was built with and the lights that are on;
+    // variants for other light setups are built when the render loop first needs them
+    if (!UUseShaderVariant(USelectShaderFeatures(gMesh, gLightBlock, gClusteredLights, gShadowMaps)))
         return EXIT_FAILURE;
-    }
-
-    // Tells opengl for each sampler to which texture unit it belongs to 
-    glUseProgram(gProgramId);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
 
     // Sets the background color of the window to black (it will be implicitly used by glClear)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-    // Enables blending for transparency
+    // Enables blending for transparency; colors are premultiplied by alpha
     glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
     // Render loop
     while (!glfwWindowShouldClose(gWindow))
@@ -255,6 +1259,9 @@ int main(int argc, char* argv[])
         // Input
         UProcessInput(gWindow);
 
+        // Takes in the texture layers decoded since the last frame and streams texture levels
+        UPollTextureArrayLoad(gTextureLoad);
+
         // Render this frame
         URender();
 
@@ -265,10 +1272,19 @@ int main(int argc, char* argv[])
     UDestroyMesh(gMesh);
 
     // Releases texture
+    UEndTextureArrayLoad(gTextureLoad);
     UDestroyTexture(gTextureId);
 
-    // Releases shader program
-    UDestroyShaderProgram(gProgramId);
+    // Releases shader programs
+    UDestroyShaderVariants();
+
+    // Releases uniform buffers
+    UDestroyUniformBuffers();
+    UDestroyClusteredLights(gClusteredLights);
+    UDestroyShadowMaps(gShadowMaps);
+
+    // Joins the worker threads
+    gThreadPool.Stop();
 
     // Terminates the program successfully
     exit(EXIT_SUCCESS);
@@ -349,6 +1365,55 @@ void UProcessInput(GLFWwindow* window)
 
     if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
         perspective = !perspective; // Toggle perspective
+
+    // Cycles the local lights through none, a few dozen and a few hundred, once per key press
+    static bool localLightKeyDown = false;
+    bool localLightKeyPressed = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+    if (localLightKeyPressed && !localLightKeyDown)
+    {
+        gLocalLightCount = gLocalLightCount == 0 ? 64 : gLocalLightCount == 64 ? 256 : 0;
+        UCreateLocalLights(gClusteredLights, gLocalLightCount);
+    }
+    localLightKeyDown = localLightKeyPressed;
+
+    // Rolls the rolling pin along the board, turning it by the distance over its radius
+    float roll = 0.0f;
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS)
+        roll += ROLLING_PIN_SPEED * gDeltaTime;
+    if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS)
+        roll -= ROLLING_PIN_SPEED * gDeltaTime;
+    const float distance = glm::clamp(gRollingPin.distance + roll, 0.0f, ROLLING_PIN_RANGE);
+    if (distance != gRollingPin.distance)
+    {
+        gRollingPin.distance = distance;
+        USetLocalTransform(gScene, gRollingPin.node, gRollingPin.placement * glm::translate(glm::vec3(-distance, 0.0f, 0.0f)) *
+            glm::rotate(distance / gRollingPin.radius, glm::vec3(0.0f, 1.0f, 0.0f)));
+    }
+}
+
+
+// Appends the per-frame statistics to the window title, a few times per second and only when they changed,
+// so the render loop never writes to the console
+void UUpdateWindowTitle(GLFWwindow* window, const GLMesh& mesh)
+{
+    static std::string shownTitle;
+    static float shownTime = -WINDOW_TITLE_INTERVAL;
+    const float now = float(glfwGetTime());
+    if (now - shownTime < WINDOW_TITLE_INTERVAL)
+        return;
+
+    std::string title = std::string(WINDOW_TITLE) + " | " + std::to_string(mesh.culledObjects) + " of " +
+        std::to_string(mesh.instances.size()) + " objects culled";
+    if (mesh.testedMeshlets > 0)
+        title += " | " + std::to_string(mesh.culledMeshlets) + " of " + std::to_string(mesh.testedMeshlets) +
+            " clusters, " + std::to_string(mesh.culledMeshletTriangles) + " of " +
+            std::to_string(mesh.testedMeshletTriangles) + " triangles culled";
+    if (title != shownTitle)
+    {
+        glfwSetWindowTitle(window, title.c_str());
+        shownTitle = title;
+    }
+    shownTime = now;
 }
 
 
@@ -434,60 +1499,18 @@ void URender()
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Bind your VAO and shader program 
+    // Bind your VAO
     glBindVertexArray(gMesh.vao);
-    glUseProgram(gProgramId);
 
-    // Setup lighting information
-    glm::vec3 keyLightPos = glm::vec3(10.0f, 0.0f, 0.0f); // Adjusted position
-    glm::vec3 keyLightColor = glm::vec3(1.0f, 1.0f, 1.0f); // Bright white
-    float keyLightIntensity = 1.0f; // 100% intensity
+    // Propagates edited scene nodes to the world matrices and the draw data of the objects they place
+    UUpdateWorldTransforms(gScene);
+    UUpdateObjectTransforms(gMesh, gScene);
 
-    glUniform3f(glGetUniformLocation(gProgramId, "keyLightPos"), keyLightPos.x, keyLightPos.y, keyLightPos.z);
-    glUniform3f(glGetUniformLocation(gProgramId, "keyLightColor"), keyLightColor.x, keyLightColor.y, keyLightColor.z);
-    glUniform1f(glGetUniformLocation(gProgramId, "keyLightIntensity"), keyLightIntensity);
+    // Re-renders the shadow maps if a light or a shadow caster changed, before the lights are uploaded
+    UUpdateShadowMaps(gShadowMaps, gMesh, gScene);
 
-    glm::vec3 fillLightPos = glm::vec3(-5.0f, 10.0f, 10.0f); // Adjusted position
-    glm::vec3 fillLightColor = glm::vec3(1.0f, 1.0f, 1.0f); // white
-    float fillLightIntensity = 0.0f; // 10% intensity
-
-    glUniform3f(glGetUniformLocation(gProgramId, "fillLightPos"), fillLightPos.x, fillLightPos.y, fillLightPos.z);
-    glUniform3f(glGetUniformLocation(gProgramId, "fillLightColor"), fillLightColor.x, fillLightColor.y, fillLightColor.z);
-    glUniform1f(glGetUniformLocation(gProgramId, "fillLightIntensity"), fillLightIntensity);
-
-    // Spotlight properties
-    glm::vec3 spotlightPosition = glm::vec3(1.0f, 5.0f, 6.0f); 
-    glm::vec3 spotlightDirection = glm::vec3(0.0f, -1.0f, -1.0f); 
-    glm::vec3 spotlightColor = glm::vec3(0.5f, 0.7f, 1.0f); // Light blue
-    float spotlightIntensity = 1.0f;
-    float spotlightCutOff = glm::cos(glm::radians(12.5f));
-    float spotlightOuterCutOff = glm::cos(glm::radians(15.0f));
-    float spotlightConstant = 1.0f;
-    float spotlightLinear = 0.09f;
-    float spotlightQuadratic = 0.032f;
-
-    // Set spotlight uniforms
-    glUniform3f(glGetUniformLocation(gProgramId, "spotlight.position"), spotlightPosition.x, spotlightPosition.y, spotlightPosition.z);
-    glUniform3f(glGetUniformLocation(gProgramId, "spotlight.direction"), spotlightDirection.x, spotlightDirection.y, spotlightDirection.z);
-    glUniform3f(glGetUniformLocation(gProgramId, "spotlight.color"), spotlightColor.x, spotlightColor.y, spotlightColor.z);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.intensity"), spotlightIntensity);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.cutOff"), spotlightCutOff);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.outerCutOff"), spotlightOuterCutOff);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.constant"), spotlightConstant);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.linear"), spotlightLinear);
-    glUniform1f(glGetUniformLocation(gProgramId, "spotlight.quadratic"), spotlightQuadratic);
-
-    // Scales the object uniformly
-    glm::mat4 scale = glm::scale(glm::vec3(1.0f, 1.0f, 1.0f));
-
-    // Rotates shape by 90 degrees around the x-axis
-    glm::mat4 rotation = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-
-    // Places object at the origin
-    glm::mat4 translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = translation * rotation * scale;
+    // Shader variant for the lights that are on; a variant that fails to build leaves the previous one in use
+    UUseShaderVariant(USelectShaderFeatures(gMesh, gLightBlock, gClusteredLights, gShadowMaps));
 
     glm::mat4 view = gCamera.GetViewMatrix();
 
@@ -495,585 +1518,3353 @@ void URender()
     glm::mat4 projection;
     if (perspective) // Ensure 'perspective' variable is correctly defined or passed
     {
-        projection = glm::perspective(glm::radians(fov), 800.0f / 600.0f, 0.1f, 100.0f);
+        projection = glm::perspective(glm::radians(fov), 800.0f / 600.0f, CLIP_NEAR, CLIP_FAR);
     }
     else
     {
-        projection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, 0.1f, 100.0f);
-    }
-
-    glUniformMatrix4fv(glGetUniformLocation(gProgramId, "model"), 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(glGetUniformLocation(gProgramId, "view"), 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(gProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Draw coordinates
-    GLuint hemisphereIndexOffset = 0;
-    GLuint hemisphereIndexCount = 59400;
-    GLuint torusIndexOffset = 59400;
-    GLuint torusIndexCount = 12000;
-    GLuint planeIndexOffset = 71400;
-    GLuint planeIndexCount = 8;
-    GLuint cylinderIndexOffset = 71406;
-    GLuint cylinderIndexCount = 2400;
-    GLuint handleIndexCount = 73806;
-    GLuint firstHandleIndexOffset = 2400;
-    GLuint cylinderTopCapIndexCount = 60;
-    GLuint cylinderTopCapIndexOffset = 73806;
-    GLuint cylinderBottomCapIndexCount = 60;
-    GLuint cylinderBottomCapIndexOffset = 73868;
-    GLuint innerCylinderTopCapIndexOffset = cylinderBottomCapIndexOffset + cylinderBottomCapIndexCount; 
-    GLuint innerCylinderTopCapIndexCount = 60;
-    GLuint innerCylinderBottomCapIndexOffset = innerCylinderTopCapIndexOffset + innerCylinderTopCapIndexCount; 
-    GLuint innerCylinderBottomCapIndexCount = 60;
-    GLuint eggsIndexOffset = 73986;
-    GLuint eggsIndexCount = 2400;
-    GLuint secondHandleIndexOffset = firstHandleIndexOffset + handleIndexCount;
-
-    glBindTexture(GL_TEXTURE_2D, gHemTor);
-    glDrawElements(GL_TRIANGLES, hemisphereIndexCount, GL_UNSIGNED_INT, (void*)(hemisphereIndexOffset * sizeof(GLuint)));
-    glDrawElements(GL_TRIANGLES, torusIndexCount, GL_UNSIGNED_INT, (void*)(torusIndexOffset * sizeof(GLuint)));
+        projection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, CLIP_NEAR, CLIP_FAR);
+    }
 
-    glActiveTexture(GL_TEXTURE0); // Activate the texture unit
-    glBindTexture(GL_TEXTURE_2D, gPlane);
-    glDrawElements(GL_TRIANGLES, planeIndexCount, GL_UNSIGNED_INT, (void*)(planeIndexOffset * sizeof(GLuint)));
-
-    // Draw the cylinder body
-    glActiveTexture(GL_TEXTURE0); // Activate the texture unit
-    glBindTexture(GL_TEXTURE_2D, gRollPin);
-    glDrawElements(GL_TRIANGLES, cylinderIndexCount, GL_UNSIGNED_INT, (void*)(cylinderIndexOffset * sizeof(GLuint)));
+    // Only re-uploads the uniforms whose contents changed since the last frame
+    UUpdateUniformBuffers(view, projection, gCamera.Position);
 
-    // Draw the first handle
-    glDrawElements(GL_TRIANGLES, handleIndexCount, GL_UNSIGNED_INT, (void*)(firstHandleIndexOffset * sizeof(GLuint)));
+    // Sorts the local lights into the froxels of this view; the tiles follow the framebuffer size
+    if (!gClusteredLights.lights.empty())
+    {
+        UAssignLightsToClusters(gClusteredLights, view, projection);
+        int framebufferWidth, framebufferHeight;
+        glfwGetFramebufferSize(gWindow, &framebufferWidth, &framebufferHeight);
+        glUniform4f(gUniforms.uClusterParams, float(framebufferWidth) / CLUSTER_GRID_X, float(framebufferHeight) / CLUSTER_GRID_Y,
+            CLIP_NEAR, CLUSTER_GRID_Z / logf(CLIP_FAR / CLIP_NEAR));
+    }
 
-    // Draw the second handle
-    glDrawElements(GL_TRIANGLES, handleIndexCount, GL_UNSIGNED_INT, (void*)(secondHandleIndexOffset * sizeof(GLuint)));
+    // Drops the primitives outside the view, picks a tessellation level for the rest, drops the
+    // hidden clusters of the dense ones and rewrites the indirect commands if the draw list changed
+    UCullObjects(gMesh, gScene, view, projection);
+    USelectLevelsOfDetail(gMesh, view, projection);
+    UCullMeshlets(gMesh, gScene, view, projection);
+    UUpdateDrawCommands(gMesh);
 
-    // Draw the cylinder top cap
-    glDrawElements(GL_TRIANGLES, cylinderTopCapIndexCount, GL_UNSIGNED_INT, (void*)(cylinderTopCapIndexOffset * sizeof(GLuint)));
+    // Asks for the texture levels the visible objects need; the next poll streams them
+    UUpdateTextureResidency(gTextureLoad, gMesh, view, projection);
 
-    // Draw the cylinder bottom cap
-    glDrawElements(GL_TRIANGLES, cylinderBottomCapIndexCount, GL_UNSIGNED_INT, (void*)(cylinderBottomCapIndexOffset * sizeof(GLuint)));
+    // Shows the culling statistics of this frame after the window title
+    UUpdateWindowTitle(gWindow, gMesh);
 
-    // Draw the inner cylinder caps
-    glDrawElements(GL_TRIANGLES, innerCylinderTopCapIndexCount, GL_UNSIGNED_INT, (void*)(innerCylinderTopCapIndexOffset * sizeof(GLuint)));
-    glDrawElements(GL_TRIANGLES, innerCylinderBottomCapIndexCount, GL_UNSIGNED_INT, (void*)(innerCylinderBottomCapIndexOffset * sizeof(GLuint)));
+    // Every material is a layer of one texture array, so the whole scene is a single multi-draw
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gShadowMaps.texture);
+    glActiveTexture(GL_TEXTURE0); // Activate the texture unit
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gTextureId);
+    glUniform1fv(gUniforms.uLayerMinLod, GLsizei(gTextureLoad.minLods.size()), &gTextureLoad.minLods[0]);
+    if (!gMesh.commands.empty())
+    {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gMesh.indirectBuffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gMesh.indexType, (void*)0, GLsizei(gMesh.commands.size()), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
 
-    // Draw the eggs
-    glDrawElements(GL_TRIANGLES, eggsIndexCount, GL_UNSIGNED_INT, (void*)(eggsIndexOffset * sizeof(GLuint)));
-    
     glBindVertexArray(0);
     glfwSwapBuffers(gWindow);
 }
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh) {
-    // hemisphere parameters
-    const unsigned int stacks = 100; // Hemisphere
-    const unsigned int sectors = 100; // Hemisphere
-    const float radius = 1.0f; // Hemisphere
-    const float PI = 3.14159265358979323846f;
-
-    // Torus parameters
-    const float torusInnerRadius = 0.1f;
-    const float torusOuterRadius = 1.0f;
-    const unsigned int torusStacks = 20;
-    const unsigned int torusSectors = 100;
+// Writes one interleaved vertex and returns the position of the next one
+float* UWriteVertex(float* vertex, const glm::vec3& position, const glm::vec3& normal, float s, float t)
+{
+    vertex[0] = position.x; vertex[1] = position.y; vertex[2] = position.z;
+    vertex[3] = normal.x; vertex[4] = normal.y; vertex[5] = normal.z;
+    vertex[6] = s; vertex[7] = t;
+    return vertex + VERTEX_FLOATS;
+}
 
-    // Cylinder parameters
-    const unsigned int cylinderStacks = 20; 
-    const unsigned int cylinderSectors = 20; 
-    const float cylinderHeight = 2.0f; // Main cylinder length
-    const float cylinderRadius = 0.2f; // Main cylinder radius
-    float cylinderTranslationX = 2.0f; 
-    float cylinderTranslationZ = 0.8f; 
 
-    // Inner cylinder parameters
-    float innerCylinderRadius = 0.05f; // Adjust the radius to be thinner
-    float innerCylinderHeight = 3.0f; 
+// Writes the two triangles of every stack/sector quad of a (stacks + 1) x (sectors + 1) vertex grid
+GLuint* UWriteGridIndices(GLuint* index, unsigned int stacks, unsigned int sectors)
+{
+    for (unsigned int i = 0; i < stacks; ++i) {
+        unsigned int k1 = i * (sectors + 1); // beginning of current stack
+        unsigned int k2 = k1 + sectors + 1; // beginning of next stack
 
-    // Egg parameters
-    const unsigned int eggStacks = 20;
-    const unsigned int eggSectors = 20;
-    const float eggRadius = 0.2f; // Base radius for the egg
-    const float eggScaleX = 0.75f; // Scale on X to make it egg-shaped
-    const float eggScaleY = 1.2f; // Scale on Y to make it egg-shaped
-    const float eggScaleZ = 0.75f; // Scale on Z to make it egg-shaped
+        for (unsigned int j = 0; j < sectors; ++j, ++k1, ++k2) {
+            *index++ = k1;
+            *index++ = k2;
+            *index++ = k1 + 1;
 
-    std::vector<float> vertices;
-    std::vector<unsigned int> indices;
+            *index++ = k1 + 1;
+            *index++ = k2;
+            *index++ = k2 + 1;
+        }
+    }
+    return index;
+}
 
-    // Adjustment for hemisphere to attach to the left side of the cylinder
-    float hemisphereTranslationX = cylinderTranslationX; // Aligned with the cylinder's center
-    float hemisphereTranslationY = -cylinderHeight / 2.0f - radius; // Left side, considering hemisphere radius
-    float hemisphereTranslationZ = cylinderTranslationZ; // Same Z as the cylinder to ensure it's on the plane
 
-    // Hemispere vertices
-    for (unsigned int i = 0; i <= stacks; ++i) {
-        float stackAngle = PI / 2 * i / stacks;
-        float xy = radius * cosf(stackAngle);
-        float z = radius * sinf(stackAngle);
+// Returns the shared sin/cos ring for a sector count, building it on first use
+const SinCosTable& UGetSinCosTable(unsigned int sectors)
+{
+    const float PI = 3.14159265358979323846f;
 
-        for (unsigned int j = 0; j <= sectors; ++j) {
+    std::lock_guard<std::mutex> lock(gSinCosTablesMutex);
+    std::unique_ptr<SinCosTable>& table = gSinCosTables[sectors];
+    if (!table)
+    {
+        // Padded to a multiple of 4 so the SIMD loop can always load full registers
+        size_t paddedCount = (sectors + 1 + 3) & ~size_t(3);
+        table.reset(new SinCosTable);
+        table->cosines.assign(paddedCount, 0.0f);
+        table->sines.assign(paddedCount, 0.0f);
+        table->u.assign(paddedCount, 0.0f);
+        for (unsigned int j = 0; j <= sectors; ++j)
+        {
             float sectorAngle = 2 * PI * j / sectors;
-
-            float x = xy * cosf(sectorAngle) + hemisphereTranslationX - 0.9;
-            float y = xy * sinf(sectorAngle) + hemisphereTranslationY + 1.5;
-            float zAdjusted = z + hemisphereTranslationZ - 0.8; 
-
-            // Push back position and texture coordinates
-            vertices.push_back(x);
-            vertices.push_back(y);
-            vertices.push_back(zAdjusted);
-            float s = (float)j / sectors;
-            float t = (float)i / stacks;
-            vertices.push_back(s);
-            vertices.push_back(t);
+            table->cosines[j] = cosf(sectorAngle);
+            table->sines[j] = sinf(sectorAngle);
+            table->u[j] = (float)j / sectors;
         }
     }
+    return *table;
+}
 
-    // Hemisphere indices
-    for (unsigned int i = 0; i < stacks; ++i) {
-        unsigned int k1 = i * (sectors + 1); // beginning of current stack
-        unsigned int k2 = k1 + sectors + 1; // beginning of next stack
 
-        for (unsigned int j = 0; j < sectors; ++j, ++k1, ++k2) {
-            if (i != 0) {
-                indices.push_back(k1);
-                indices.push_back(k2);
-                indices.push_back(k1 + 1);
-            }
-            if (i != (stacks - 1)) {
-                indices.push_back(k1 + 1);
-                indices.push_back(k2);
-                indices.push_back(k2 + 1);
-            }
-        }
+// Evaluates one ring of a parametric surface: count vertices at sectors 0..count-1 of the table
+void UEvaluateRing(const SurfaceRing& ring, const SinCosTable& table, unsigned int count, float t, float* vertex)
+{
+    const glm::vec3 center = ring.center;
+    unsigned int j = 0;
+
+#ifdef U_USE_SSE2
+    // Four vertices per iteration: position and normal are both center + u * cos + v * sin
+    const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+    const __m128 ux = _mm_set1_ps(ring.axisU.x), uy = _mm_set1_ps(ring.axisU.y), uz = _mm_set1_ps(ring.axisU.z);
+    const __m128 vx = _mm_set1_ps(ring.axisV.x), vy = _mm_set1_ps(ring.axisV.y), vz = _mm_set1_ps(ring.axisV.z);
+    const __m128 ncx = _mm_set1_ps(ring.normalCenter.x), ncy = _mm_set1_ps(ring.normalCenter.y), ncz = _mm_set1_ps(ring.normalCenter.z);
+    const __m128 nux = _mm_set1_ps(ring.normalU.x), nuy = _mm_set1_ps(ring.normalU.y), nuz = _mm_set1_ps(ring.normalU.z);
+    const __m128 nvx = _mm_set1_ps(ring.normalV.x), nvy = _mm_set1_ps(ring.normalV.y), nvz = _mm_set1_ps(ring.normalV.z);
+    const __m128 tt = _mm_set1_ps(t);
+
+    for (; j + 4 <= count; j += 4, vertex += 4 * VERTEX_FLOATS)
+    {
+        __m128 c = _mm_loadu_ps(&table.cosines[j]);
+        __m128 s = _mm_loadu_ps(&table.sines[j]);
+
+        __m128 px = _mm_add_ps(cx, _mm_add_ps(_mm_mul_ps(ux, c), _mm_mul_ps(vx, s)));
+        __m128 py = _mm_add_ps(cy, _mm_add_ps(_mm_mul_ps(uy, c), _mm_mul_ps(vy, s)));
+        __m128 pz = _mm_add_ps(cz, _mm_add_ps(_mm_mul_ps(uz, c), _mm_mul_ps(vz, s)));
+
+        __m128 nx = _mm_add_ps(ncx, _mm_add_ps(_mm_mul_ps(nux, c), _mm_mul_ps(nvx, s)));
+        __m128 ny = _mm_add_ps(ncy, _mm_add_ps(_mm_mul_ps(nuy, c), _mm_mul_ps(nvy, s)));
+        __m128 nz = _mm_add_ps(ncz, _mm_add_ps(_mm_mul_ps(nuz, c), _mm_mul_ps(nvz, s)));
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_add_ps(_mm_mul_ps(ny, ny), _mm_mul_ps(nz, nz))));
+        nx = _mm_div_ps(nx, length);
+        ny = _mm_div_ps(ny, length);
+        nz = _mm_div_ps(nz, length);
+
+        __m128 u = _mm_loadu_ps(&table.u[j]);
+        __m128 v = tt;
+
+        // Transposes the component registers into four interleaved vertices
+        _MM_TRANSPOSE4_PS(px, py, pz, nx);
+        _MM_TRANSPOSE4_PS(ny, nz, u, v);
+        _mm_storeu_ps(vertex + 0 * VERTEX_FLOATS, px); _mm_storeu_ps(vertex + 0 * VERTEX_FLOATS + 4, ny);
+        _mm_storeu_ps(vertex + 1 * VERTEX_FLOATS, py); _mm_storeu_ps(vertex + 1 * VERTEX_FLOATS + 4, nz);
+        _mm_storeu_ps(vertex + 2 * VERTEX_FLOATS, pz); _mm_storeu_ps(vertex + 2 * VERTEX_FLOATS + 4, u);
+        _mm_storeu_ps(vertex + 3 * VERTEX_FLOATS, nx); _mm_storeu_ps(vertex + 3 * VERTEX_FLOATS + 4, v);
     }
+#endif
 
-    unsigned int hemisphereVertexCount = (stacks + 1) * (sectors + 1);
+    // Remaining vertices, or all of them without SSE2
+    for (; j < count; ++j)
+    {
+        float c = table.cosines[j];
+        float s = table.sines[j];
+        glm::vec3 position = center + ring.axisU * c + ring.axisV * s;
+        glm::vec3 normal = glm::normalize(ring.normalCenter + ring.normalU * c + ring.normalV * s);
+        vertex = UWriteVertex(vertex, position, normal, table.u[j], t);
+    }
+}
 
-    // Calculate torus vertical adjustment
-    float torusVerticalAdjustment = radius + torusInnerRadius; 
 
-    // Torus vertices to sit on top of the hemisphere
-    for (unsigned int i = 0; i <= torusStacks; ++i) {
-        float stackAngle = 2 * PI * i / torusStacks;
-        for (unsigned int j = 0; j <= torusSectors; ++j) {
-            float sectorAngle = 2 * PI * j / torusSectors;
+// Generates the (stacks + 1) x (sectors + 1) vertex grid of any surface functor returning a SurfaceRing per stack
+template <typename Surface>
+void UGenerateSurface(const Surface& surface, unsigned int stacks, unsigned int sectors, float* vertices)
+{
+    const SinCosTable& table = UGetSinCosTable(sectors);
+    for (unsigned int i = 0; i <= stacks; ++i)
+    {
+        UEvaluateRing(surface(i, stacks), table, sectors + 1, (float)i / stacks, vertices);
+        vertices += (sectors + 1) * VERTEX_FLOATS;
+    }
+}
+
 
-            float x = (torusOuterRadius + torusInnerRadius * cosf(sectorAngle)) * cosf(stackAngle) + 1.1;
-            float y = (torusOuterRadius + torusInnerRadius * cosf(sectorAngle)) * sinf(stackAngle) + torusVerticalAdjustment + hemisphereTranslationY + 0.4; // Adjust for vertical positioning on top of the hemisphere
-            float z = torusInnerRadius * sinf(sectorAngle);
+// Hemisphere rising along +Z from its rim
+struct HemisphereSurface
+{
+    float radius;
 
-            // Push back position and texture coordinates with appropriate adjustments
-            vertices.push_back(x);
-            vertices.push_back(y); // Y is adjusted to place the torus on top of the hemisphere
-            vertices.push_back(z);
-            vertices.push_back((float)j / torusSectors);
-            vertices.push_back((float)i / torusStacks);
-        }
+    SurfaceRing operator()(unsigned int stack, unsigned int stacks) const
+    {
+        const float PI = 3.14159265358979323846f;
+        float stackAngle = PI / 2 * stack / stacks;
+        float xy = cosf(stackAngle);
+        float z = sinf(stackAngle);
+
+        SurfaceRing ring;
+        ring.center = glm::vec3(0.0f, 0.0f, radius * z);
+        ring.axisU = glm::vec3(radius * xy, 0.0f, 0.0f);
+        ring.axisV = glm::vec3(0.0f, radius * xy, 0.0f);
+        ring.normalCenter = glm::vec3(0.0f, 0.0f, z);
+        ring.normalU = glm::vec3(xy, 0.0f, 0.0f);
+        ring.normalV = glm::vec3(0.0f, xy, 0.0f);
+        return ring;
     }
+};
 
-    // Torus indices
-    for (unsigned int i = 0; i < torusStacks; ++i) {
-        unsigned int k1 = hemisphereVertexCount + i * (torusSectors + 1);
-        unsigned int k2 = k1 + torusSectors + 1;
 
-        for (unsigned int j = 0; j < torusSectors; ++j, ++k1, ++k2) {
-            indices.push_back(k1);
-            indices.push_back(k2);
-            indices.push_back(k1 + 1);
+// Torus in the XY plane: stacks go around the ring, sectors around the tube
+struct TorusSurface
+{
+    float tubeRadius;
+    float ringRadius;
 
-            indices.push_back(k1 + 1);
-            indices.push_back(k2);
-            indices.push_back(k2 + 1);
-        }
+    SurfaceRing operator()(unsigned int stack, unsigned int stacks) const
+    {
+        const float PI = 3.14159265358979323846f;
+        float stackAngle = 2 * PI * stack / stacks;
+        glm::vec3 radial(cosf(stackAngle), sinf(stackAngle), 0.0f);
+
+        SurfaceRing ring;
+        ring.center = radial * ringRadius;
+        ring.axisU = radial * tubeRadius;
+        ring.axisV = glm::vec3(0.0f, 0.0f, tubeRadius);
+        ring.normalCenter = glm::vec3(0.0f);
+        ring.normalU = radial;
+        ring.normalV = glm::vec3(0.0f, 0.0f, 1.0f);
+        return ring;
     }
+};
 
-    // Plane vertices and texture coordinates
-    const float planeSize = 5.0f;
-    const float planeHeight = 1.0f; // Height of the plane
-    unsigned int planeVertexStartIndex = vertices.size() / 5; // Start index for plane vertices
 
-    // Bottom left
-    vertices.push_back(-planeSize); vertices.push_back(-planeSize); vertices.push_back(planeHeight);
-    vertices.push_back(0.0f); vertices.push_back(0.0f);
+// Open cylinder along Y, centered on its height
+struct CylinderSurface
+{
+    float radius;
+    float height;
+
+    SurfaceRing operator()(unsigned int stack, unsigned int stacks) const
+    {
+        SurfaceRing ring;
+        ring.center = glm::vec3(0.0f, (float)stack / stacks * height - (height / 2.0f), 0.0f);
+        ring.axisU = glm::vec3(radius, 0.0f, 0.0f);
+        ring.axisV = glm::vec3(0.0f, 0.0f, radius);
+        ring.normalCenter = glm::vec3(0.0f);
+        ring.normalU = glm::vec3(1.0f, 0.0f, 0.0f);
+        ring.normalV = glm::vec3(0.0f, 0.0f, 1.0f);
+        return ring;
+    }
+};
 
-    // Bottom right
-    vertices.push_back(planeSize); vertices.push_back(-planeSize); vertices.push_back(planeHeight);
-    vertices.push_back(1.0f); vertices.push_back(0.0f);
 
-    // Top right
-    vertices.push_back(planeSize); vertices.push_back(planeSize); vertices.push_back(planeHeight);
-    vertices.push_back(1.0f); vertices.push_back(1.0f);
+// Ellipsoid standing along Y
+struct EggSurface
+{
+    float radius;
+    glm::vec3 scale;
 
-    // Top left
-    vertices.push_back(-planeSize); vertices.push_back(planeSize); vertices.push_back(planeHeight);
-    vertices.push_back(0.0f); vertices.push_back(1.0f);
+    SurfaceRing operator()(unsigned int stack, unsigned int stacks) const
+    {
+        const float PI = 3.14159265358979323846f;
+        float stackAngle = PI * stack / stacks;
+        float sinStack = sinf(stackAngle);
+        float cosStack = cosf(stackAngle);
+
+        // The normal is the gradient of (x/sx)^2 + (y/sy)^2 + (z/sz)^2
+        SurfaceRing ring;
+        ring.center = glm::vec3(0.0f, radius * cosStack * scale.y, 0.0f);
+        ring.axisU = glm::vec3(radius * sinStack * scale.x, 0.0f, 0.0f);
+        ring.axisV = glm::vec3(0.0f, 0.0f, radius * sinStack * scale.z);
+        ring.normalCenter = glm::vec3(0.0f, cosStack / scale.y, 0.0f);
+        ring.normalU = glm::vec3(sinStack / scale.x, 0.0f, 0.0f);
+        ring.normalV = glm::vec3(0.0f, 0.0f, sinStack / scale.z);
+        return ring;
+    }
+};
 
-    // Plane indices
-    indices.push_back(planeVertexStartIndex);
-    indices.push_back(planeVertexStartIndex + 1);
-    indices.push_back(planeVertexStartIndex + 2);
 
-    indices.push_back(planeVertexStartIndex);
-    indices.push_back(planeVertexStartIndex + 2);
-    indices.push_back(planeVertexStartIndex + 3);
+// Computes how many vertices and indices a primitive generates, without generating it
+void UCountPrimitive(const PrimitiveDesc& primitive, GLuint& vertexCount, GLuint& indexCount)
+{
+    const unsigned int stacks = primitive.stacks;
+    const unsigned int sectors = primitive.sectors;
 
-    unsigned int cylinderVertexStartIndex = vertices.size() / 5;
+    // Unknown types generate nothing
+    vertexCount = 0;
+    indexCount = 0;
+    switch (primitive.type)
+    {
+    case PRIMITIVE_HEMISPHERE:
+        // The first triangle of the bottom stack and the second of the top stack are skipped
+        vertexCount = (stacks + 1) * (sectors + 1);
+        indexCount = stacks * sectors * 6 - sectors * 6;
+        break;
 
-    // Cylinder vertices (Rolling Pin Body)
-    for (unsigned int i = 0; i <= cylinderStacks; ++i) {
-        float y = (float)i / cylinderStacks * cylinderHeight - (cylinderHeight / 2.0f); // Centered on the height
-        for (unsigned int j = 0; j <= cylinderSectors; ++j) {
-            float sectorAngle = 2 * PI * j / cylinderSectors;
-            float x = cylinderRadius * cosf(sectorAngle) + cylinderTranslationX; // Translate horizontally
-            float z = cylinderRadius * sinf(sectorAngle) + cylinderTranslationZ; // Adjust height to sit on plane
+    case PRIMITIVE_TORUS:
+    case PRIMITIVE_CYLINDER:
+    case PRIMITIVE_EGG:
+        vertexCount = (stacks + 1) * (sectors + 1);
+        indexCount = stacks * sectors * 6;
+        break;
 
-            // Texture coordinates
-            float s = (float)j / cylinderSectors; // Horizontal wrap of texture
-            float t = (float)i / cylinderStacks; // Vertical stretch of texture
+    case PRIMITIVE_PLANE:
+        vertexCount = 4;
+        indexCount = 6;
+        break;
 
-            // Push position and texture coordinates
-            vertices.push_back(x); // Adjusted for horizontal position
-            vertices.push_back(y); // y is used for length along the "rolling pin"
-            vertices.push_back(z);
-            vertices.push_back(s);
-            vertices.push_back(t);
-        }
+    case PRIMITIVE_CAP:
+        vertexCount = 1 + sectors;
+        indexCount = sectors * 3;
+        break;
     }
+}
 
-    // Cylinder indices
-    for (unsigned int i = 0; i < cylinderStacks; ++i) {
-        unsigned int k1 = cylinderVertexStartIndex + i * (cylinderSectors + 1); // beginning of current stack
-        unsigned int k2 = k1 + cylinderSectors + 1; // beginning of next stack
 
-        for (unsigned int j = 0; j < cylinderSectors; ++j, ++k1, ++k2) {
-            indices.push_back(k1);
-            indices.push_back(k2);
-            indices.push_back(k1 + 1);
+// Generates a primitive into its own region of the vertex and index arrays; indices are local to the primitive
+void UGeneratePrimitive(const PrimitiveDesc& primitive, float* vertices, GLuint* indices)
+{
+    const unsigned int stacks = primitive.stacks;
+    const unsigned int sectors = primitive.sectors;
+    float* vertex = vertices;
 
-            indices.push_back(k1 + 1);
-            indices.push_back(k2);
-            indices.push_back(k2 + 1);
+    switch (primitive.type)
+    {
+    case PRIMITIVE_HEMISPHERE:
+    {
+        // Hemispere vertices
+        HemisphereSurface surface = { primitive.radius };
+        UGenerateSurface(surface, stacks, sectors, vertices);
+
+        // Hemisphere indices
+        GLuint* index = indices;
+        for (unsigned int i = 0; i < stacks; ++i) {
+            unsigned int k1 = i * (sectors + 1); // beginning of current stack
+            unsigned int k2 = k1 + sectors + 1; // beginning of next stack
+
+            for (unsigned int j = 0; j < sectors; ++j, ++k1, ++k2) {
+                if (i != 0) {
+                    *index++ = k1;
+                    *index++ = k2;
+                    *index++ = k1 + 1;
+                }
+                if (i != (stacks - 1)) {
+                    *index++ = k1 + 1;
+                    *index++ = k2;
+                    *index++ = k2 + 1;
+                }
+            }
         }
+        break;
+    }
+
+    case PRIMITIVE_TORUS:
+    {
+        // Torus vertices: stacks go around the ring, sectors around the tube
+        TorusSurface surface = { primitive.radius, primitive.length };
+        UGenerateSurface(surface, stacks, sectors, vertices);
+        UWriteGridIndices(indices, stacks, sectors);
+        break;
     }
 
-    unsigned int innerCylinderVertexStartIndex = vertices.size() / 5;
+    case PRIMITIVE_PLANE:
+    {
+        // The plane faces -Z, towards the objects resting on it
+        const float size = primitive.radius;
+        const glm::vec3 normal(0.0f, 0.0f, -1.0f);
+        vertex = UWriteVertex(vertex, glm::vec3(-size, -size, 0.0f), normal, 0.0f, 0.0f); // Bottom left
+        vertex = UWriteVertex(vertex, glm::vec3(size, -size, 0.0f), normal, 1.0f, 0.0f); // Bottom right
+        vertex = UWriteVertex(vertex, glm::vec3(size, size, 0.0f), normal, 1.0f, 1.0f); // Top right
+        vertex = UWriteVertex(vertex, glm::vec3(-size, size, 0.0f), normal, 0.0f, 1.0f); // Top left
+
+        // Plane indices
+        const GLuint planeIndices[] = { 0, 1, 2, 0, 2, 3 };
+        memcpy(indices, planeIndices, sizeof(planeIndices));
+        break;
+    }
 
-    // Vertices for the inner cylinder
-    for (unsigned int i = 0; i <= cylinderStacks; ++i) {
-        float y = (float)i / cylinderStacks * innerCylinderHeight - (innerCylinderHeight / 2.0f); // Centered on the height
-        for (unsigned int j = 0; j <= cylinderSectors; ++j) {
-            float sectorAngle = 2 * PI * j / cylinderSectors;
-            float x = innerCylinderRadius * cosf(sectorAngle) + cylinderTranslationX; 
-            float z = innerCylinderRadius * sinf(sectorAngle) + cylinderTranslationZ; 
+    case PRIMITIVE_CYLINDER:
+    {
+        // Cylinder vertices, centered on the height along Y
+        CylinderSurface surface = { primitive.radius, primitive.length };
+        UGenerateSurface(surface, stacks, sectors, vertices);
+        UWriteGridIndices(indices, stacks, sectors);
+        break;
+    }
 
-            // Texture coordinates
-            float s = (float)j / cylinderSectors; // Horizontal wrap of texture
-            float t = (float)i / cylinderStacks; // Vertical stretch of texture
+    case PRIMITIVE_EGG:
+    {
+        EggSurface surface = { primitive.radius, primitive.scale };
+        UGenerateSurface(surface, stacks, sectors, vertices);
+        UWriteGridIndices(indices, stacks, sectors);
+        break;
+    }
 
-            // Push position and texture coordinates for the thinner cylinder
-            vertices.push_back(x);
-            vertices.push_back(y);
-            vertices.push_back(z);
-            vertices.push_back(s);
-            vertices.push_back(t);
+    case PRIMITIVE_CAP:
+    {
+        // Center vertex, then one ring vertex per sector, facing up
+        const glm::vec3 normal(0.0f, 1.0f, 0.0f);
+        vertex = UWriteVertex(vertex, glm::vec3(0.0f), normal, 0.5f, 0.5f); // Texture coordinates for the center
+
+        // Position and texture coordinates share one table lookup per ring vertex
+        const SinCosTable& table = UGetSinCosTable(sectors);
+        GLuint* index = indices;
+        for (unsigned int j = 1; j <= sectors; ++j) {
+            float c = table.cosines[j];
+            float s = table.sines[j];
+            glm::vec3 position(primitive.radius * c, 0.0f, primitive.radius * s);
+            vertex = UWriteVertex(vertex, position, normal, (c + 1.0f) * 0.5f, (s + 1.0f) * 0.5f);
+
+            GLuint next = (j < sectors) ? j + 1 : 1; // The last triangle closes the fan
+            *index++ = 0;
+            *index++ = j;
+            *index++ = next;
         }
+        break;
+    }
     }
+}
 
-    // Indices for the inner cylinder
-    for (unsigned int i = 0; i < cylinderStacks; ++i) {
-        unsigned int k1 = innerCylinderVertexStartIndex + i * (cylinderSectors + 1);
-        unsigned int k2 = k1 + cylinderSectors + 1;
 
-        for (unsigned int j = 0; j < cylinderSectors; ++j, ++k1, ++k2) {
-            indices.push_back(k1);
-            indices.push_back(k2);
-            indices.push_back(k1 + 1);
+// Conservative object-space bounds of a primitive, known before it is generated
+void UComputePrimitiveBounds(const PrimitiveDesc& primitive, glm::vec3& boundsMin, glm::vec3& boundsMax)
+{
+    const float r = primitive.radius;
+    glm::vec3 extent(0.0f);
+    glm::vec3 center(0.0f);
 
-            indices.push_back(k1 + 1);
-            indices.push_back(k2);
-            indices.push_back(k2 + 1);
-        }
+    switch (primitive.type)
+    {
+    case PRIMITIVE_HEMISPHERE:
+        extent = glm::vec3(r, r, r * 0.5f);
+        center = glm::vec3(0.0f, 0.0f, r * 0.5f);
+        break;
+    case PRIMITIVE_TORUS:
+        extent = glm::vec3(primitive.length + r, primitive.length + r, r);
+        break;
+    case PRIMITIVE_PLANE:
+        extent = glm::vec3(r, r, 0.0f);
+        break;
+    case PRIMITIVE_CYLINDER:
+        extent = glm::vec3(r, primitive.length / 2.0f, r);
+        break;
+    case PRIMITIVE_EGG:
+        extent = r * primitive.scale;
+        break;
+    case PRIMITIVE_CAP:
+        extent = glm::vec3(r, 0.0f, r);
+        break;
     }
 
-    // Calculate the positions based on the right end of the cylinder
-    float cylinderEndX = cylinderTranslationX + cylinderRadius - 0.1f;
-
-    const float eggSeparation = 0.1f;
+    boundsMin = center - extent;
+    boundsMax = center + extent;
+}
 
-    // Position of the first egg (lying horizontally)
-    const float egg1PositionX = cylinderEndX + eggRadius * eggScaleX + eggSeparation + 0.0;
-    const float egg1PositionY = 0.5f;
-    const float egg1PositionZ = cylinderTranslationZ + 0.05; // Adjusted Z position
 
-    // Position of the second egg (vertically standing, next to the first egg)
-    const float egg2PositionX = egg1PositionX + 1.3 * eggRadius * eggScaleX + eggSeparation - 0.3;
-    const float egg2PositionY = 0.12f;
-    const float egg2PositionZ = cylinderTranslationZ - 0.05f;
+// Octahedral encoding of a unit normal into two snorm16 components
+void UEncodeOctahedral(const glm::vec3& normal, GLshort* encoded)
+{
+    glm::vec3 n = normal / (fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z));
+    glm::vec2 e(n.x, n.y);
+    if (n.z < 0.0f)
+    {
+        // Folds the lower hemisphere over the diagonals
+        e = glm::vec2((1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+            (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    encoded[0] = GLshort(glm::round(glm::clamp(e.x, -1.0f, 1.0f) * 32767.0f));
+    encoded[1] = GLshort(glm::round(glm::clamp(e.y, -1.0f, 1.0f) * 32767.0f));
+}
 
-    float cosAngleX = cosf(PI / 2); // Cosine of rotation angle for 90 degrees
-    float sinAngleX = sinf(PI / 2); // Sine of rotation angle for 90 degrees
-
-    for (int egg = 0; egg < 2; ++egg) {
-        float eggPositionX = (egg == 1) ? egg2PositionX : egg1PositionX;
-        float eggPositionY = (egg == 1) ? egg2PositionY : egg1PositionY;
-        // Assign the correct Z position based on the egg index
-        float eggPositionZ = (egg == 1) ? egg2PositionZ : egg1PositionZ;
-
-        unsigned int eggVertexStartIndex = vertices.size() / 5; // 5 components per vertex (x, y, z, s, t)
-        for (unsigned int i = 0; i <= eggStacks; ++i) {
-            float stackAngle = PI * i / eggStacks;
-            for (unsigned int j = 0; j <= eggSectors; ++j) {
-                float sectorAngle = 2 * PI * j / eggSectors;
-                float x = eggRadius * cosf(sectorAngle) * sinf(stackAngle) * eggScaleX;
-                float y = eggRadius * cosf(stackAngle) * eggScaleY;
-                float z = eggRadius * sinf(sectorAngle) * sinf(stackAngle) * eggScaleZ;
-                if (egg == 1) {
-                    float tempY = y;
-
-                    // Rotate around the X-axis to lay the egg down
-                    y = cosAngleX * tempY - sinAngleX * z;
-                    z = sinAngleX * tempY + cosAngleX * z;
-                }
 
-                // Translate vertices to their final positions
-                x += eggPositionX;
-                y += eggPositionY;
-                z += eggPositionZ;
-
-                vertices.push_back(x);
-                vertices.push_back(y);
-                vertices.push_back(z);
-                float s = (float)j / eggSectors;
-                float t = (float)i / eggStacks;
-                vertices.push_back(s);
-                vertices.push_back(t);
+// Quantizes float vertices and 32-bit indices into the compact layout, one job per submesh
+void UEncodeCompactMesh(const std::vector<GLSubMesh>& subMeshes, const float* vertices, const GLuint* indices,
+    CompactVertex* compactVertices, GLushort* compactIndices)
+{
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        const GLSubMesh* subMesh = &subMeshes[i];
+        gThreadPool.Submit([subMesh, vertices, indices, compactVertices, compactIndices]()
+        {
+            glm::vec3 center = (subMesh->boundsMin + subMesh->boundsMax) * 0.5f;
+            glm::vec3 extent = (subMesh->boundsMax - subMesh->boundsMin) * 0.5f;
+            glm::vec3 invExtent(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+            for (GLuint v = 0; v < subMesh->vertexCount; ++v)
+            {
+                const float* source = vertices + (subMesh->baseVertex + v) * VERTEX_FLOATS;
+                CompactVertex& target = compactVertices[subMesh->baseVertex + v];
+
+                glm::vec3 position = glm::clamp((glm::vec3(source[0], source[1], source[2]) - center) * invExtent, -1.0f, 1.0f);
+                target.position[0] = GLshort(glm::round(position.x * 32767.0f));
+                target.position[1] = GLshort(glm::round(position.y * 32767.0f));
+                target.position[2] = GLshort(glm::round(position.z * 32767.0f));
+                target.position[3] = 32767;
+                UEncodeOctahedral(glm::vec3(source[3], source[4], source[5]), target.normal);
+                target.texCoord[0] = GLushort(glm::round(glm::clamp(source[6], 0.0f, 1.0f) * 65535.0f));
+                target.texCoord[1] = GLushort(glm::round(glm::clamp(source[7], 0.0f, 1.0f) * 65535.0f));
             }
-        }
 
-        // Indices generation
-        for (unsigned int i = 0; i < eggStacks; ++i) {
-            for (unsigned int j = 0; j < eggSectors; ++j) {
-                unsigned int first = eggVertexStartIndex + i * (eggSectors + 1) + j;
-                unsigned int second = first + eggSectors + 1;
+            // Indices are already local to the submesh, so they fit in 16 bits
+            for (GLuint k = subMesh->firstIndex; k < subMesh->firstIndex + subMesh->indexCount; ++k)
+                compactIndices[k] = GLushort(indices[k]);
+        });
+    }
+    gThreadPool.Wait();
+}
 
-                indices.push_back(first);
-                indices.push_back(second);
-                indices.push_back(first + 1);
 
-                indices.push_back(first + 1);
-                indices.push_back(second);
-                indices.push_back(second + 1);
-            }
+// Starts writing the contents of a new buffer: through a write-only mapping of immutable storage,
+// or into a staging copy when buffer storage is unavailable or the mapping fails
+void* UBeginBufferWrite(BufferWriter& writer, GLenum target, GLuint buffer, GLsizeiptr size, bool useBufferStorage)
+{
+    writer.target = target;
+    writer.buffer = buffer;
+    writer.size = size;
+    writer.mapped = false;
+    writer.immutable = useBufferStorage;
+
+    glBindBuffer(target, buffer);
+    if (useBufferStorage)
+    {
+        glBufferStorage(target, size, NULL, GL_MAP_WRITE_BIT);
+        void* data = glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (data)
+        {
+            writer.mapped = true;
+            return data;
         }
     }
 
-    // Top cap for the OUTER cylinder
-    float topYOuter = cylinderHeight / 2.0f; // Top cap y coordinate for the outer cylinder
-    unsigned int topCenterIndexOuter = vertices.size() / 5; // Index of the top center vertex for the outer cylinder
+    writer.staging.resize(size_t(size));
+    return &writer.staging[0];
+}
 
-    // Center vertex for the OUTER cylinder top cap
-    vertices.push_back(cylinderTranslationX); vertices.push_back(topYOuter); vertices.push_back(cylinderTranslationZ);
-    vertices.push_back(0.5f); vertices.push_back(0.5f); // Texture coordinates for the center
 
-    // Outer cylinder top cap vertices and indices
-    for (unsigned int j = 1; j <= cylinderSectors; ++j) {
-        float sectorAngle = 2 * PI * j / cylinderSectors;
-        float x = cylinderRadius * cosf(sectorAngle) + cylinderTranslationX;
-        float z = cylinderRadius * sinf(sectorAngle) + cylinderTranslationZ;
+// Publishes the written contents; returns false if the buffer must be recreated and written again
+bool UEndBufferWrite(BufferWriter& writer)
+{
+    glBindBuffer(writer.target, writer.buffer);
+    if (writer.mapped)
+        return glUnmapBuffer(writer.target) == GL_TRUE;
 
-        vertices.push_back(x); vertices.push_back(topYOuter); vertices.push_back(z);
-        vertices.push_back((cosf(sectorAngle) + 1.0f) * 0.5f); vertices.push_back((sinf(sectorAngle) + 1.0f) * 0.5f);
+    // A failed mapping has already allocated immutable storage, which glBufferData cannot respecify
+    if (writer.immutable)
+        return false;
 
-        if (j < cylinderSectors) { // Add triangles for top cap
-            indices.push_back(topCenterIndexOuter);
-            indices.push_back(topCenterIndexOuter + j);
-            indices.push_back(topCenterIndexOuter + j + 1);
-        }
-    }
-    indices.push_back(topCenterIndexOuter); 
-    indices.push_back(topCenterIndexOuter + cylinderSectors);
-    indices.push_back(topCenterIndexOuter + 1);
+    glBufferData(writer.target, writer.size, &writer.staging[0], GL_STATIC_DRAW);
+    return true;
+}
 
-    // Bottom cap for the OUTER cylinder
-    float bottomYOuter = -cylinderHeight / 2.0f; // Bottom cap y coordinate for the outer cylinder
-    unsigned int bottomCenterIndexOuter = vertices.size() / 5; // Index of the bottom center vertex for the outer cylinder
 
-    // Center vertex for the OUTER cylinder bottom cap
-    vertices.push_back(cylinderTranslationX); vertices.push_back(bottomYOuter); vertices.push_back(cylinderTranslationZ);
-    vertices.push_back(0.5f); vertices.push_back(0.5f); // Texture coordinates for the center
+// Welds matching vertices of one submesh, drops degenerate triangles and unreferenced vertices;
+// the result is packed at the start of the submesh's region and the counts are updated
+void UWeldSubMesh(float* vertices, GLuint* indices, GLuint& vertexCount, GLuint& indexCount)
+{
+    // Vertices are grouped by position and normal, then by texture coordinates within each group, so
+    // normal seams always survive and plain duplicates always collapse
+    std::unordered_map<WeldKey, GLuint, WeldKeyHash> groups;
+    std::unordered_map<WeldKey, GLuint, WeldKeyHash> unique;
+    groups.reserve(vertexCount);
+    unique.reserve(vertexCount);
+    std::vector<GLuint> group(vertexCount);
+    std::vector<GLuint> remap(vertexCount);
+    std::vector<GLuint> groupTexCoords(vertexCount, 0);
+    std::vector<glm::vec2> groupTexCoordSums(vertexCount, glm::vec2(0.0f));
+    std::vector<glm::vec2> groupTexCoordMins(vertexCount, glm::vec2(FLT_MAX));
+    std::vector<glm::vec2> groupTexCoordMaxs(vertexCount, glm::vec2(-FLT_MAX));
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        WeldKey key;
+        for (GLuint c = 0; c < VERTEX_FLOATS; ++c)
+            key.q[c] = GLint(floorf(vertices[v * VERTEX_FLOATS + c] / WELD_EPSILON + 0.5f));
+        std::pair<std::unordered_map<WeldKey, GLuint, WeldKeyHash>::iterator, bool> inserted = unique.insert(std::make_pair(key, v));
+        remap[v] = inserted.first->second;
+
+        key.q[6] = key.q[7] = 0;
+        group[v] = groups.insert(std::make_pair(key, v)).first->second;
+        if (inserted.second)
+        {
+            const glm::vec2 texCoord = glm::make_vec2(vertices + v * VERTEX_FLOATS + 6);
+            ++groupTexCoords[group[v]];
+            groupTexCoordSums[group[v]] += texCoord;
+            groupTexCoordMins[group[v]] = glm::min(groupTexCoordMins[group[v]], texCoord);
+            groupTexCoordMaxs[group[v]] = glm::max(groupTexCoordMaxs[group[v]], texCoord);
+        }
+    }
 
-    // Outer cylinder bottom cap vertices and indices
-    for (unsigned int j = 1; j <= cylinderSectors; ++j) {
-        float sectorAngle = 2 * PI * j / cylinderSectors;
-        float x = cylinderRadius * cosf(sectorAngle) + cylinderTranslationX;
-        float z = cylinderRadius * sinf(sectorAngle) + cylinderTranslationZ;
+    // A seam keeps one vertex per side, as its triangles interpolate towards different ends of the texture.
+    // A collapsed ring has one texture coordinate per sector along one axis although its mapping is singular
+    // anyway, so it welds into a single vertex at the ring's average texture coordinate. Corners where two
+    // seams cross, such as the torus's, keep every side
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        const GLuint first = group[v];
+        const glm::vec2 spread = groupTexCoordMaxs[first] - groupTexCoordMins[first];
+        if (groupTexCoords[first] <= WELD_SEAM_TEXTURE_COORDINATES || (spread.x > WELD_EPSILON && spread.y > WELD_EPSILON))
+            continue;
+        remap[v] = first;
+        if (v == first)
+        {
+            const glm::vec2 texCoord = groupTexCoordSums[first] / float(groupTexCoords[first]);
+            vertices[v * VERTEX_FLOATS + 6] = texCoord.x;
+            vertices[v * VERTEX_FLOATS + 7] = texCoord.y;
+        }
+    }
 
-        vertices.push_back(x); vertices.push_back(bottomYOuter); vertices.push_back(z);
-        vertices.push_back((cosf(sectorAngle) + 1.0f) * 0.5f); vertices.push_back((sinf(sectorAngle) + 1.0f) * 0.5f);
+    // Triangles collapsed by the welding, or with no area such as those fanning into a pole, are dropped
+    GLuint keptIndices = 0;
+    for (GLuint k = 0; k + 2 < indexCount; k += 3)
+    {
+        GLuint a = remap[indices[k]], b = remap[indices[k + 1]], c = remap[indices[k + 2]];
+        if (a == b || b == c || c == a)
+            continue;
+
+        glm::vec3 pa = glm::make_vec3(vertices + a * VERTEX_FLOATS);
+        glm::vec3 edge1 = glm::make_vec3(vertices + b * VERTEX_FLOATS) - pa;
+        glm::vec3 edge2 = glm::make_vec3(vertices + c * VERTEX_FLOATS) - pa;
+        glm::vec3 normal = glm::cross(edge1, edge2);
+        if (glm::dot(normal, normal) <= DEGENERATE_SINE * DEGENERATE_SINE * glm::dot(edge1, edge1) * glm::dot(edge2, edge2))
+            continue;
+
+        indices[keptIndices++] = a;
+        indices[keptIndices++] = b;
+        indices[keptIndices++] = c;
+    }
 
-        if (j < cylinderSectors) { // Add triangles for bottom cap, reversing order
-            indices.push_back(bottomCenterIndexOuter);
-            indices.push_back(bottomCenterIndexOuter + j + 1);
-            indices.push_back(bottomCenterIndexOuter + j);
-        }
+    // Packs the referenced vertices, keeping their order
+    const GLuint unassigned = ~GLuint(0);
+    std::vector<GLuint> packed(vertexCount, unassigned);
+    for (GLuint k = 0; k < keptIndices; ++k)
+        packed[indices[k]] = 0;
+    GLuint keptVertices = 0;
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        if (packed[v] == unassigned)
+            continue;
+        packed[v] = keptVertices;
+        if (keptVertices != v)
+            memcpy(vertices + keptVertices * VERTEX_FLOATS, vertices + v * VERTEX_FLOATS, VERTEX_FLOATS * sizeof(float));
+        ++keptVertices;
     }
-    indices.push_back(bottomCenterIndexOuter); 
-    indices.push_back(bottomCenterIndexOuter + 1);
-    indices.push_back(bottomCenterIndexOuter + cylinderSectors);
+    for (GLuint k = 0; k < keptIndices; ++k)
+        indices[k] = packed[indices[k]];
 
-    // Top cap for the INNER cylinder
-    float topYInner = innerCylinderHeight / 2.0f; // Top cap y coordinate for the inner cylinder
-    unsigned int topCenterIndexInner = vertices.size() / 5; // Index of the top center vertex for the inner cylinder
+    vertexCount = keptVertices;
+    indexCount = keptIndices;
+}
 
-    // Center vertex for the INNER cylinder top cap
-    vertices.push_back(cylinderTranslationX); vertices.push_back(topYInner); vertices.push_back(cylinderTranslationZ);
-    vertices.push_back(0.5f); vertices.push_back(0.5f); // Texture coordinates for the center
 
-    // Inner cylinder top cap vertices and indices
-    for (unsigned int j = 1; j <= cylinderSectors; ++j) {
-        float sectorAngle = 2 * PI * j / cylinderSectors;
-        float x = innerCylinderRadius * cosf(sectorAngle) + cylinderTranslationX;
-        float z = innerCylinderRadius * sinf(sectorAngle) + cylinderTranslationZ;
+// Welds every submesh in parallel, then closes the gaps between their regions and reports what was removed
+void UWeldMesh(std::vector<GLSubMesh>& subMeshes, std::vector<float>& vertices, std::vector<GLuint>& indices)
+{
+    GLuint vertexCountBefore = 0, indexCountBefore = 0;
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        GLSubMesh* subMesh = &subMeshes[i];
+        vertexCountBefore += subMesh->vertexCount;
+        indexCountBefore += subMesh->indexCount;
 
-        vertices.push_back(x); vertices.push_back(topYInner); vertices.push_back(z);
-        vertices.push_back((cosf(sectorAngle) + 1.0f) * 0.5f); vertices.push_back((sinf(sectorAngle) + 1.0f) * 0.5f);
+        float* subMeshVertices = &vertices[0] + subMesh->baseVertex * VERTEX_FLOATS;
+        GLuint* subMeshIndices = &indices[0] + subMesh->firstIndex;
+        gThreadPool.Submit([subMesh, subMeshVertices, subMeshIndices]()
+        {
+            UWeldSubMesh(subMeshVertices, subMeshIndices, subMesh->vertexCount, subMesh->indexCount);
+        });
+    }
+    gThreadPool.Wait();
 
-        if (j < cylinderSectors) { 
-            indices.push_back(topCenterIndexInner);
-            indices.push_back(topCenterIndexInner + j);
-            indices.push_back(topCenterIndexInner + j + 1);
-        }
+    // Regions only shrink, so moving them down in order never overwrites one that is still to be moved
+    GLuint vertexCount = 0, indexCount = 0;
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        GLSubMesh& subMesh = subMeshes[i];
+        memmove(&vertices[vertexCount * VERTEX_FLOATS], &vertices[subMesh.baseVertex * VERTEX_FLOATS], subMesh.vertexCount * VERTEX_FLOATS * sizeof(float));
+        memmove(&indices[indexCount], &indices[subMesh.firstIndex], subMesh.indexCount * sizeof(GLuint));
+        subMesh.baseVertex = GLint(vertexCount);
+        subMesh.firstIndex = indexCount;
+        vertexCount += subMesh.vertexCount;
+        indexCount += subMesh.indexCount;
     }
-    indices.push_back(topCenterIndexInner); 
-    indices.push_back(topCenterIndexInner + cylinderSectors);
-    indices.push_back(topCenterIndexInner + 1);
+    vertices.resize(vertexCount * VERTEX_FLOATS);
+    indices.resize(indexCount);
+
+    cout << "INFO: Welding removed " << vertexCountBefore - vertexCount << " of " << vertexCountBefore << " vertices ("
+        << 100.0f * (vertexCountBefore - vertexCount) / vertexCountBefore << "%) and " << (indexCountBefore - indexCount) / 3
+        << " triangles" << endl;
+}
+
 
-    // Bottom cap for the INNER cylinder
-    float bottomYInner = -innerCylinderHeight / 2.0f; // Bottom cap y coordinate for the inner cylinder
-    unsigned int bottomCenterIndexInner = vertices.size() / 5; // Index of the bottom center vertex for the inner cylinder
+// Forsyth score of a vertex from its position in the simulated LRU cache and its remaining triangles
+float UForsythVertexScore(int cachePosition, GLuint remainingTriangles)
+{
+    if (remainingTriangles == 0)
+        return -1.0f;
 
-    // Center vertex for the INNER cylinder bottom cap
-    vertices.push_back(cylinderTranslationX); vertices.push_back(bottomYInner); vertices.push_back(cylinderTranslationZ);
-    vertices.push_back(0.5f); vertices.push_back(0.5f); // Texture coordinates for the center
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        // The last triangle's vertices score the same so strips do not get favored
+        if (cachePosition < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - float(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+    }
 
-    // Inner cylinder bottom cap vertices and indices
-    for (unsigned int j = 1; j <= cylinderSectors; ++j) {
-        float sectorAngle = 2 * PI * j / cylinderSectors;
-        float x = innerCylinderRadius * cosf(sectorAngle) + cylinderTranslationX;
-        float z = innerCylinderRadius * sinf(sectorAngle) + cylinderTranslationZ;
+    // Boosts vertices with few triangles left so they get finished off
+    return score + 2.0f * powf(float(remainingTriangles), -0.5f);
+}
 
-        vertices.push_back(x); vertices.push_back(bottomYInner); vertices.push_back(z);
-        vertices.push_back((cosf(sectorAngle) + 1.0f) * 0.5f); vertices.push_back((sinf(sectorAngle) + 1.0f) * 0.5f);
 
-        if (j < cylinderSectors) { // Add triangles for bottom cap, reversing order
-            indices.push_back(bottomCenterIndexInner);
-            indices.push_back(bottomCenterIndexInner + j + 1);
-            indices.push_back(bottomCenterIndexInner + j);
+// Reorders the triangles of a submesh for post-transform cache reuse (Tom Forsyth's linear-speed algorithm)
+void UOptimizeVertexCache(GLuint* indices, GLuint indexCount, GLuint vertexCount)
+{
+    const GLuint triangleCount = indexCount / 3;
+    const std::vector<GLuint> source(indices, indices + indexCount);
+
+    // Triangles using each vertex; the first remaining[v] entries of a vertex's list are still to be emitted
+    std::vector<GLuint> remaining(vertexCount, 0);
+    std::vector<GLuint> adjacencyOffsets(vertexCount + 1, 0);
+    std::vector<GLuint> adjacency(indexCount);
+    for (GLuint k = 0; k < indexCount; ++k)
+        ++remaining[source[k]];
+    for (GLuint v = 0; v < vertexCount; ++v)
+        adjacencyOffsets[v + 1] = adjacencyOffsets[v] + remaining[v];
+    std::vector<GLuint> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for (GLuint k = 0; k < indexCount; ++k)
+        adjacency[fill[source[k]]++] = k / 3;
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    std::vector<char> emitted(triangleCount, 0);
+    for (GLuint v = 0; v < vertexCount; ++v)
+        vertexScore[v] = UForsythVertexScore(-1, remaining[v]);
+
+    std::vector<GLuint> cache;
+    std::vector<GLuint> newCache;
+    GLuint scanCursor = 0;
+    GLint best = -1;
+    GLuint* output = indices;
+
+    for (GLuint emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        // Nothing useful in the cache: continue with the next triangle in generation order
+        if (best < 0)
+        {
+            while (emitted[scanCursor])
+                ++scanCursor;
+            best = GLint(scanCursor);
         }
-    }
-    indices.push_back(bottomCenterIndexInner); 
-    indices.push_back(bottomCenterIndexInner + 1);
-    indices.push_back(bottomCenterIndexInner + cylinderSectors);
 
-    // Generate VAO, VBO, and EBO
-    glGenVertexArrays(1, &mesh.vao);
-    glGenBuffers(1, &mesh.vbo);
-    glGenBuffers(1, &mesh.ebo);
+        const GLuint* triangle = &source[best * 3];
+        emitted[best] = 1;
+        newCache.clear();
+        for (int c = 0; c < 3; ++c)
+        {
+            GLuint v = triangle[c];
+            *output++ = v;
+            newCache.push_back(v);
+
+            // Drops the triangle from the vertex's remaining list
+            GLuint* list = &adjacency[adjacencyOffsets[v]];
+            for (GLuint a = 0; a < remaining[v]; ++a)
+            {
+                if (list[a] == GLuint(best))
+                {
+                    std::swap(list[a], list[remaining[v] - 1]);
+                    break;
+                }
+            }
+            --remaining[v];
+        }
 
-    glBindVertexArray(mesh.vao);
+        // Emitted vertices move to the front of the cache; the rest shift back and may fall out
+        for (size_t c = 0; c < cache.size(); ++c)
+        {
+            if (cache[c] != triangle[0] && cache[c] != triangle[1] && cache[c] != triangle[2])
+                newCache.push_back(cache[c]);
+        }
+        for (size_t c = 0; c < newCache.size(); ++c)
+        {
+            GLuint v = newCache[c];
+            cachePosition[v] = c < FORSYTH_CACHE_SIZE ? int(c) : -1;
+            vertexScore[v] = UForsythVertexScore(cachePosition[v], remaining[v]);
+        }
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+        // Rescores the triangles touching the cache and picks the best one for the next step
+        best = -1;
+        float bestScore = -1.0f;
+        for (size_t c = 0; c < newCache.size(); ++c)
+        {
+            GLuint v = newCache[c];
+            for (GLuint a = 0; a < remaining[v]; ++a)
+            {
+                GLuint t = adjacency[adjacencyOffsets[v] + a];
+                float score = vertexScore[source[t * 3]] + vertexScore[source[t * 3 + 1]] + vertexScore[source[t * 3 + 2]];
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    best = GLint(t);
+                }
+            }
+        }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        if (newCache.size() > FORSYTH_CACHE_SIZE)
+            newCache.resize(FORSYTH_CACHE_SIZE);
+        cache.swap(newCache);
+    }
+}
 
-    // Position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
 
-    // Texture coordinate attribute
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+// Renumbers the vertices of a submesh in the order the indices first use them, for linear vertex fetches
+void UOptimizeVertexFetch(float* vertices, GLuint* indices, GLuint indexCount, GLuint vertexCount)
+{
+    const GLuint unassigned = ~GLuint(0);
+    std::vector<GLuint> remap(vertexCount, unassigned);
+    GLuint next = 0;
+    for (GLuint k = 0; k < indexCount; ++k)
+    {
+        if (remap[indices[k]] == unassigned)
+            remap[indices[k]] = next++;
+        indices[k] = remap[indices[k]];
+    }
 
-    // Unbind the VAO
-    glBindVertexArray(0);
+    // Unreferenced vertices keep their relative order at the end
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        if (remap[v] == unassigned)
+            remap[v] = next++;
+    }
 
-    // Save the total count of indices for rendering
-    mesh.nIndices = indices.size();
+    std::vector<float> source(vertices, vertices + vertexCount * VERTEX_FLOATS);
+    for (GLuint v = 0; v < vertexCount; ++v)
+        memcpy(vertices + remap[v] * VERTEX_FLOATS, &source[v * VERTEX_FLOATS], VERTEX_FLOATS * sizeof(float));
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Counts the vertex shader invocations of an index list on a FIFO post-transform cache
+GLuint USimulateVertexCache(const GLuint* indices, GLuint indexCount, GLuint vertexCount)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    std::vector<GLuint> timestamps(vertexCount, 0);
+    GLuint time = VERTEX_CACHE_SIZE + 1;
+    GLuint misses = 0;
+    for (GLuint k = 0; k < indexCount; ++k)
+    {
+        GLuint v = indices[k];
+        if (time - timestamps[v] > VERTEX_CACHE_SIZE)
+        {
+            timestamps[v] = time++;
+            ++misses;
+        }
+    }
+    return misses;
 }
 
 
-/*Generates and loads the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Optimizes every submesh for the vertex cache and vertex fetch, reporting ACMR/ATVR before and after
+void UOptimizeMesh(const std::vector<GLSubMesh>& subMeshes, float* vertices, GLuint* indices)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    std::vector<GLuint> missesBefore(subMeshes.size());
+    std::vector<GLuint> missesAfter(subMeshes.size());
+    for (size_t i = 0; i < subMeshes.size(); ++i)
     {
-        flipImageVertically(image, width, height, channels);
+        const GLSubMesh* subMesh = &subMeshes[i];
+        GLuint* before = &missesBefore[i];
+        GLuint* after = &missesAfter[i];
+        gThreadPool.Submit([subMesh, vertices, indices, before, after]()
+        {
+            float* subMeshVertices = vertices + subMesh->baseVertex * VERTEX_FLOATS;
+            GLuint* subMeshIndices = indices + subMesh->firstIndex;
+            *before = USimulateVertexCache(subMeshIndices, subMesh->indexCount, subMesh->vertexCount);
+            UOptimizeVertexCache(subMeshIndices, subMesh->indexCount, subMesh->vertexCount);
+            UOptimizeVertexFetch(subMeshVertices, subMeshIndices, subMesh->indexCount, subMesh->vertexCount);
+            *after = USimulateVertexCache(subMeshIndices, subMesh->indexCount, subMesh->vertexCount);
+        });
+    }
+    gThreadPool.Wait();
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    // ACMR: transformed vertices per triangle; ATVR: transformed vertices per vertex
+    GLuint triangleCount = 0, vertexCount = 0, totalBefore = 0, totalAfter = 0;
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        triangleCount += subMeshes[i].indexCount / 3;
+        vertexCount += subMeshes[i].vertexCount;
+        totalBefore += missesBefore[i];
+        totalAfter += missesAfter[i];
+    }
+    cout << "INFO: Vertex cache: ACMR " << float(totalBefore) / triangleCount << " -> " << float(totalAfter) / triangleCount
+        << ", ATVR " << float(totalBefore) / vertexCount << " -> " << float(totalAfter) / vertexCount << endl;
+}
 
-        // Sets the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-        // Sets texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Splits a submesh into runs of consecutive triangles of at most MESHLET_MAX_VERTICES distinct vertices and
+// MESHLET_MAX_TRIANGLES triangles; the vertex cache order already keeps neighboring triangles together
+void UBuildSubMeshMeshlets(const GLSubMesh& subMesh, const float* vertices, const GLuint* indices, std::vector<GLMeshlet>& meshlets)
+{
+    // Meshlet each vertex was last counted in; a corner repeated within a triangle is counted twice,
+    // which only ever closes a meshlet early
+    std::vector<GLuint> vertexMeshlet(subMesh.vertexCount, ~0u);
+    GLMeshlet meshlet = GLMeshlet();
+    GLuint meshletVertices = 0;
+    for (GLuint i = 0; i < subMesh.indexCount; i += 3)
+    {
+        GLuint newVertices = 0;
+        for (int corner = 0; corner < 3; ++corner)
+            newVertices += vertexMeshlet[indices[i + corner]] != GLuint(meshlets.size());
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+        if (meshletVertices + newVertices > MESHLET_MAX_VERTICES || meshlet.indexCount == MESHLET_MAX_TRIANGLES * 3)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            meshlets.push_back(meshlet);
+            meshlet.firstIndex = i;
+            meshlet.indexCount = 0;
+            meshletVertices = 0;
+            newVertices = 3;
         }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
-
-        return true;
+        for (int corner = 0; corner < 3; ++corner)
+            vertexMeshlet[indices[i + corner]] = GLuint(meshlets.size());
+        meshletVertices += newVertices;
+        meshlet.indexCount += 3;
     }
+    if (meshlet.indexCount > 0)
+        meshlets.push_back(meshlet);
 
-    // Error loading the image
-    return false;
+    for (size_t m = 0; m < meshlets.size(); ++m)
+    {
+        UComputeMeshletBounds(vertices, indices, meshlets[m]);
+        meshlets[m].firstIndex += subMesh.firstIndex;
+    }
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Bounding sphere and normal cone of a meshlet; its indices are still relative to the submesh
+void UComputeMeshletBounds(const float* vertices, const GLuint* indices, GLMeshlet& meshlet)
 {
+    const GLuint* meshletIndices = indices + meshlet.firstIndex;
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (GLuint i = 0; i < meshlet.indexCount; ++i)
+    {
+        const float* position = vertices + meshletIndices[i] * VERTEX_FLOATS;
+        boundsMin = glm::min(boundsMin, glm::vec3(position[0], position[1], position[2]));
+        boundsMax = glm::max(boundsMax, glm::vec3(position[0], position[1], position[2]));
+    }
+    meshlet.center = (boundsMin + boundsMax) * 0.5f;
+    meshlet.radius = 0.0f;
+    for (GLuint i = 0; i < meshlet.indexCount; ++i)
+    {
+        const float* position = vertices + meshletIndices[i] * VERTEX_FLOATS;
+        meshlet.radius = std::max(meshlet.radius, glm::length(glm::vec3(position[0], position[1], position[2]) - meshlet.center));
+    }
+
+    // Face normals decide what is seen, but the winding is not consistent across the generators,
+    // so each one is turned towards the vertex normals of its corners
+    std::vector<glm::vec3> faceNormals;
+    faceNormals.reserve(meshlet.indexCount / 3);
+    glm::vec3 axis(0.0f);
+    for (GLuint i = 0; i < meshlet.indexCount; i += 3)
+    {
+        const float* a = vertices + meshletIndices[i] * VERTEX_FLOATS;
+        const float* b = vertices + meshletIndices[i + 1] * VERTEX_FLOATS;
+        const float* c = vertices + meshletIndices[i + 2] * VERTEX_FLOATS;
+        glm::vec3 pa(a[0], a[1], a[2]), pb(b[0], b[1], b[2]), pc(c[0], c[1], c[2]);
+        glm::vec3 normal = glm::cross(pb - pa, pc - pa);
+        float area = glm::length(normal);
+        if (area <= 0.0f)
+            continue;
+        normal /= area;
+        glm::vec3 shadingNormal(a[3] + b[3] + c[3], a[4] + b[4] + c[4], a[5] + b[5] + c[5]);
+        if (glm::dot(normal, shadingNormal) < 0.0f)
+            normal = -normal;
+        faceNormals.push_back(normal);
+        axis += normal;
+    }
+
+    meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+    meshlet.coneCutoff = 1.0f;
+    float axisLength = glm::length(axis);
+    if (faceNormals.empty() || axisLength <= 0.0f)
+        return;
+    axis /= axisLength;
+    float minCosine = 1.0f;
+    for (size_t i = 0; i < faceNormals.size(); ++i)
+        minCosine = std::min(minCosine, glm::dot(faceNormals[i], axis));
+    meshlet.coneAxis = axis;
+    if (minCosine > MESHLET_MIN_CONE_COSINE)
+        meshlet.coneCutoff = sqrtf(1.0f - minCosine * minCosine);
+}
+
+
+// Builds the meshlets of every submesh as an independent job, then gathers them in submesh order
+void UBuildMeshlets(std::vector<GLSubMesh>& subMeshes, const float* vertices, const GLuint* indices, std::vector<GLMeshlet>& meshlets)
+{
+    std::vector<std::vector<GLMeshlet>> subMeshMeshlets(subMeshes.size());
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        const GLSubMesh* subMesh = &subMeshes[i];
+        std::vector<GLMeshlet>* output = &subMeshMeshlets[i];
+        gThreadPool.Submit([subMesh, vertices, indices, output]()
+        {
+            UBuildSubMeshMeshlets(*subMesh, vertices + subMesh->baseVertex * VERTEX_FLOATS, indices + subMesh->firstIndex, *output);
+        });
+    }
+    gThreadPool.Wait();
+
+    meshlets.clear();
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        subMeshes[i].firstMeshlet = GLuint(meshlets.size());
+        subMeshes[i].meshletCount = GLuint(subMeshMeshlets[i].size());
+        meshlets.insert(meshlets.end(), subMeshMeshlets[i].begin(), subMeshMeshlets[i].end());
+    }
+
+    GLuint triangleCount = 0;
+    for (size_t i = 0; i < subMeshes.size(); ++i)
+        triangleCount += subMeshes[i].indexCount / 3;
+    cout << "INFO: Meshlets: " << meshlets.size() << " clusters, " << float(triangleCount) / std::max<size_t>(meshlets.size(), 1)
+        << " triangles each on average" << endl;
+}
+
+
+// Generates every primitive as an independent job writing straight into its region of the arrays
+void UGeneratePrimitives(const std::vector<PrimitiveDesc>& primitives, const std::vector<GLSubMesh>& subMeshes, float* vertices, GLuint* indices)
+{
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        const PrimitiveDesc* primitive = &primitives[i];
+        float* primitiveVertices = vertices + subMeshes[i].baseVertex * VERTEX_FLOATS;
+        GLuint* primitiveIndices = indices + subMeshes[i].firstIndex;
+        gThreadPool.Submit([primitive, primitiveVertices, primitiveIndices]()
+        {
+            UGeneratePrimitive(*primitive, primitiveVertices, primitiveIndices);
+        });
+    }
+    gThreadPool.Wait();
+}
+
+
+// Hashes everything the processed mesh buffers depend on: the generator parameters of every submesh
+// and the post-processing toggles
+uint64_t UHashMeshParameters(const std::vector<PrimitiveDesc>& primitives)
+{
+    uint64_t hash = FNV64_OFFSET_BASIS;
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        // Field by field, so padding bytes never reach the hash
+        const PrimitiveDesc& primitive = primitives[i];
+        const int type = primitive.type;
+        hash = UHashBytes(&type, sizeof(type), hash);
+        hash = UHashBytes(&primitive.stacks, sizeof(primitive.stacks), hash);
+        hash = UHashBytes(&primitive.sectors, sizeof(primitive.sectors), hash);
+        hash = UHashBytes(&primitive.radius, sizeof(primitive.radius), hash);
+        hash = UHashBytes(&primitive.length, sizeof(primitive.length), hash);
+        hash = UHashBytes(&primitive.scale[0], sizeof(float) * 3, hash);
+    }
+
+    const unsigned char toggles[3] = { gCompactVertices, gWeldVertices, gOptimizeVertexCache };
+    return UHashBytes(toggles, sizeof(toggles), hash);
+}
+
+
+// Maps the mesh cache file and checks that it holds the buffers for these parameters. A truncated or
+// corrupt file is rejected before anything is copied out of it: the payload sizes must match the
+// counts, the file must hold all of them, and the submesh table must stay within the buffers
+bool UOpenMeshCache(const std::string& path, uint64_t parameterHash, size_t subMeshCount, MappedFile& file)
+{
+    if (!UMapFile(path, file))
+        return false;
+
+    const MeshCacheHeader* header = (const MeshCacheHeader*)file.data;
+    bool valid = file.size >= sizeof(MeshCacheHeader) &&
+        memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) == 0 &&
+        header->version == MESH_CACHE_VERSION && header->parameterHash == parameterHash &&
+        header->subMeshCount == subMeshCount;
+    if (valid)
+    {
+        // The counts are 32-bit, so none of these products or sums can wrap around
+        const uint64_t vertexSize = header->compactVertices ? sizeof(CompactVertex) : VERTEX_FLOATS * sizeof(float);
+        const uint64_t indexSize = header->compactVertices ? sizeof(GLushort) : sizeof(GLuint);
+        valid = header->vertexBytes == header->vertexCount * vertexSize &&
+            header->indexBytes == header->indexCount * indexSize &&
+            uint64_t(file.size) >= sizeof(MeshCacheHeader) + uint64_t(subMeshCount) * sizeof(GLSubMesh) +
+                uint64_t(header->meshletCount) * sizeof(GLMeshlet) + header->vertexBytes + header->indexBytes;
+    }
+    for (size_t i = 0; valid && i < subMeshCount; ++i)
+    {
+        GLSubMesh subMesh;
+        memcpy(&subMesh, file.data + sizeof(MeshCacheHeader) + i * sizeof(GLSubMesh), sizeof(GLSubMesh));
+        valid = subMesh.baseVertex >= 0 &&
+            uint64_t(subMesh.baseVertex) + subMesh.vertexCount <= header->vertexCount &&
+            uint64_t(subMesh.firstIndex) + subMesh.indexCount <= header->indexCount &&
+            uint64_t(subMesh.firstMeshlet) + subMesh.meshletCount <= header->meshletCount;
+    }
+    if (!valid)
+        UUnmapFile(file);
+    return valid;
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(GLMesh& mesh, SceneGraph& scene) {
+    // hemisphere parameters
+    const unsigned int stacks = 100; // Hemisphere
+    const unsigned int sectors = 100; // Hemisphere
+    const float radius = 1.0f; // Hemisphere
+
+    // Torus parameters
+    const float torusInnerRadius = 0.1f;
+    const float torusOuterRadius = 1.0f;
+    const unsigned int torusStacks = 20;
+    const unsigned int torusSectors = 100;
+
+    // Cylinder parameters
+    const unsigned int cylinderStacks = 20; 
+    const unsigned int cylinderSectors = 20; 
+    const float cylinderHeight = 2.0f; // Main cylinder length
+    const float cylinderRadius = 0.2f; // Main cylinder radius
+    float cylinderTranslationX = 2.0f; 
+    float cylinderTranslationZ = 0.8f; 
+
+    // Inner cylinder parameters
+    float innerCylinderRadius = 0.05f; // Adjust the radius to be thinner
+    float innerCylinderHeight = 3.0f; 
+
+    // Egg parameters
+    const unsigned int eggStacks = 20;
+    const unsigned int eggSectors = 20;
+    const float eggRadius = 0.2f; // Base radius for the egg
+    const float eggScaleX = 0.75f; // Scale on X to make it egg-shaped
+    const float eggScaleY = 1.2f; // Scale on Y to make it egg-shaped
+    const float eggScaleZ = 0.75f; // Scale on Z to make it egg-shaped
+
+    // Plane parameters
+    const float planeSize = 5.0f;
+    const float planeHeight = 1.0f; // Height of the plane
+
+    // Adjustment for hemisphere to attach to the left side of the cylinder
+    float hemisphereTranslationX = cylinderTranslationX; // Aligned with the cylinder's center
+    float hemisphereTranslationY = -cylinderHeight / 2.0f - radius; // Left side, considering hemisphere radius
+    float hemisphereTranslationZ = cylinderTranslationZ; // Same Z as the cylinder to ensure it's on the plane
+
+    // Calculate torus vertical adjustment
+    float torusVerticalAdjustment = radius + torusInnerRadius; 
+
+    // Calculate the positions based on the right end of the cylinder
+    float cylinderEndX = cylinderTranslationX + cylinderRadius - 0.1f;
+
+    const float eggSeparation = 0.1f;
+
+    // Position of the first egg (lying horizontally)
+    const float egg1PositionX = cylinderEndX + eggRadius * eggScaleX + eggSeparation + 0.0;
+    const float egg1PositionY = 0.5f;
+    const float egg1PositionZ = cylinderTranslationZ + 0.05; // Adjusted Z position
+
+    // Position of the second egg (vertically standing, next to the first egg)
+    const float egg2PositionX = egg1PositionX + 1.3 * eggRadius * eggScaleX + eggSeparation - 0.3;
+    const float egg2PositionY = 0.12f;
+    const float egg2PositionZ = cylinderTranslationZ - 0.05f;
+
+    // Placement lives in the scene graph, so the geometry stays in object space. The whole scene is
+    // rotated by 90 degrees around the x-axis, and the rolling pin parts hang off a node of their own
+    scene = SceneGraph();
+    const GLuint sceneRoot = UAddSceneNode(scene, -1, glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)));
+    const GLuint rollingPin = UAddSceneNode(scene, GLint(sceneRoot), glm::translate(glm::vec3(cylinderTranslationX, 0.0f, cylinderTranslationZ)));
+    gRollingPin.node = rollingPin;
+    gRollingPin.placement = scene.local[rollingPin];
+    gRollingPin.radius = cylinderRadius;
+    gRollingPin.distance = 0.0f;
+
+    // Library of shared meshes; the cylinder, egg and cap are unit-sized and scaled by their instances
+    std::vector<PrimitiveDesc> primitives;
+    auto addPrimitive = [&](PrimitiveType type, unsigned int primitiveStacks, unsigned int primitiveSectors,
+        float primitiveRadius, float length)
+    {
+        PrimitiveDesc primitive;
+        primitive.type = type;
+        primitive.stacks = primitiveStacks;
+        primitive.sectors = primitiveSectors;
+        primitive.radius = primitiveRadius;
+        primitive.length = length;
+        primitive.scale = glm::vec3(eggScaleX, eggScaleY, eggScaleZ);
+        primitives.push_back(primitive);
+        return GLuint(primitives.size() - 1);
+    };
+
+    const GLuint hemisphereMesh = addPrimitive(PRIMITIVE_HEMISPHERE, stacks, sectors, radius, 0.0f);
+    const GLuint torusMesh = addPrimitive(PRIMITIVE_TORUS, torusStacks, torusSectors, torusInnerRadius, torusOuterRadius);
+    const GLuint planeMesh = addPrimitive(PRIMITIVE_PLANE, 0, 0, planeSize, 0.0f);
+    const GLuint cylinderMesh = addPrimitive(PRIMITIVE_CYLINDER, cylinderStacks, cylinderSectors, 1.0f, 1.0f);
+    const GLuint eggMesh = addPrimitive(PRIMITIVE_EGG, eggStacks, eggSectors, 1.0f, 0.0f);
+    const GLuint capMesh = addPrimitive(PRIMITIVE_CAP, 0, cylinderSectors, 1.0f, 0.0f);
+
+    // Every object of the scene: a library mesh, its material and the scene node placing it
+    mesh.instances.clear();
+    auto addInstance = [&](GLuint chain, MaterialId material, GLuint parent, const glm::mat4& placement)
+    {
+        GLInstance instance;
+        instance.chain = chain;
+        instance.node = UAddSceneNode(scene, GLint(parent), placement);
+        instance.material = material;
+        instance.level = 0;
+        instance.visible = true;
+        instance.clustered = false;
+        mesh.instances.push_back(instance);
+    };
+
+    addInstance(hemisphereMesh, MATERIAL_GLASS, sceneRoot,
+        glm::translate(glm::vec3(hemisphereTranslationX - 0.9f, hemisphereTranslationY + 1.5f, hemisphereTranslationZ - 0.8f)));
+    // Torus to sit on top of the hemisphere
+    addInstance(torusMesh, MATERIAL_GLASS, sceneRoot, glm::translate(glm::vec3(1.1f, torusVerticalAdjustment + hemisphereTranslationY + 0.4f, 0.0f)));
+    addInstance(planeMesh, MATERIAL_GRAY, sceneRoot, glm::translate(glm::vec3(0.0f, 0.0f, planeHeight)));
+    // Rolling pin body and the thinner handle cylinder running through it
+    addInstance(cylinderMesh, MATERIAL_WOOD, rollingPin, glm::scale(glm::vec3(cylinderRadius, cylinderHeight, cylinderRadius)));
+    addInstance(cylinderMesh, MATERIAL_WOOD, rollingPin, glm::scale(glm::vec3(innerCylinderRadius, innerCylinderHeight, innerCylinderRadius)));
+    addInstance(eggMesh, MATERIAL_WOOD, sceneRoot,
+        glm::translate(glm::vec3(egg1PositionX, egg1PositionY, egg1PositionZ)) * glm::scale(glm::vec3(eggRadius)));
+    // The second egg is laid down by a 90 degree rotation around X
+    addInstance(eggMesh, MATERIAL_WOOD, sceneRoot, glm::translate(glm::vec3(egg2PositionX, egg2PositionY, egg2PositionZ)) *
+        glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)) * glm::scale(glm::vec3(eggRadius)));
+    // Top and bottom caps for the OUTER and INNER cylinders; bottom caps are top caps turned upside down
+    const glm::mat4 upsideDown = glm::rotate(glm::radians(180.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    addInstance(capMesh, MATERIAL_WOOD, rollingPin,
+        glm::translate(glm::vec3(0.0f, cylinderHeight / 2.0f, 0.0f)) * glm::scale(glm::vec3(cylinderRadius, 1.0f, cylinderRadius)));
+    addInstance(capMesh, MATERIAL_WOOD, rollingPin,
+        glm::translate(glm::vec3(0.0f, -cylinderHeight / 2.0f, 0.0f)) * upsideDown * glm::scale(glm::vec3(cylinderRadius, 1.0f, cylinderRadius)));
+    addInstance(capMesh, MATERIAL_WOOD, rollingPin,
+        glm::translate(glm::vec3(0.0f, innerCylinderHeight / 2.0f, 0.0f)) * glm::scale(glm::vec3(innerCylinderRadius, 1.0f, innerCylinderRadius)));
+    addInstance(capMesh, MATERIAL_WOOD, rollingPin,
+        glm::translate(glm::vec3(0.0f, -innerCylinderHeight / 2.0f, 0.0f)) * upsideDown * glm::scale(glm::vec3(innerCylinderRadius, 1.0f, innerCylinderRadius)));
+
+    // Expands every curved primitive into its level-of-detail chain; each level becomes a submesh of its own
+    std::vector<PrimitiveDesc> levels;
+    mesh.lodChains.clear();
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        const PrimitiveDesc& primitive = primitives[i];
+        GLLodChain chain;
+        chain.firstSubMesh = GLuint(levels.size());
+        const GLuint maxLevelCount = (primitive.type == PRIMITIVE_PLANE || primitive.type == PRIMITIVE_CAP) ? 1 : LOD_LEVEL_COUNT;
+        // The hemisphere is an open bowl and the cylinder has separate caps, so their insides can be seen
+        chain.closed = primitive.type == PRIMITIVE_TORUS || primitive.type == PRIMITIVE_EGG;
+        chain.levelCount = 0;
+        for (GLuint level = 0; level < maxLevelCount; ++level)
+        {
+            PrimitiveDesc reduced = primitive;
+            reduced.stacks = std::max(primitive.stacks >> level, std::min(primitive.stacks, LOD_MIN_STACKS));
+            reduced.sectors = std::max(primitive.sectors >> level, std::min(primitive.sectors, LOD_MIN_SECTORS));
+            // Levels are picked by their sectors, so once the clamp stops reducing them the chain ends
+            if (level > 0 && reduced.sectors == chain.levelSectors[level - 1])
+                break;
+            chain.levelSectors[level] = reduced.sectors;
+            levels.push_back(reduced);
+            ++chain.levelCount;
+        }
+        mesh.lodChains.push_back(chain);
+    }
+    primitives.swap(levels);
+
+    // Sizes the shared arrays up front so every primitive owns a fixed region of them
+    GLuint vertexCount = 0;
+    GLuint indexCount = 0;
+    mesh.subMeshes.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        GLuint primitiveVertexCount, primitiveIndexCount;
+        UCountPrimitive(primitives[i], primitiveVertexCount, primitiveIndexCount);
+
+        GLSubMesh& subMesh = mesh.subMeshes[i];
+        subMesh.firstIndex = indexCount;
+        subMesh.indexCount = primitiveIndexCount;
+        subMesh.baseVertex = GLint(vertexCount);
+        subMesh.vertexCount = primitiveVertexCount;
+        UComputePrimitiveBounds(primitives[i], subMesh.boundsMin, subMesh.boundsMax);
+        subMesh.firstMeshlet = 0;
+        subMesh.meshletCount = 0;
+
+        vertexCount += primitiveVertexCount;
+        indexCount += primitiveIndexCount;
+    }
+
+    // Every level of a chain shares the bounds of the finest one
+    for (size_t i = 0; i < mesh.lodChains.size(); ++i)
+    {
+        GLLodChain& chain = mesh.lodChains[i];
+        const GLSubMesh& subMesh = mesh.subMeshes[chain.firstSubMesh];
+        chain.boundsMin = subMesh.boundsMin;
+        chain.boundsMax = subMesh.boundsMax;
+    }
+
+    // Warm starts map the processed buffers from the mesh cache and skip generation altogether
+    const double meshStartTime = glfwGetTime();
+    const uint64_t parameterHash = UHashMeshParameters(primitives);
+    char cacheName[32];
+    snprintf(cacheName, sizeof(cacheName), "%016llx.umesh", (unsigned long long)parameterHash);
+    const std::string cachePath = std::string(CACHE_DIRECTORY) + cacheName;
+    MappedFile cachedMesh = { NULL, 0 };
+    const bool cached = gCacheMeshes && UOpenMeshCache(cachePath, parameterHash, mesh.subMeshes.size(), cachedMesh);
+    const unsigned char* cachedPayload = NULL;
+    mesh.meshlets.clear();
+    if (cached)
+    {
+        const MeshCacheHeader* header = (const MeshCacheHeader*)cachedMesh.data;
+        cachedPayload = cachedMesh.data + sizeof(MeshCacheHeader);
+        memcpy(&mesh.subMeshes[0], cachedPayload, mesh.subMeshes.size() * sizeof(GLSubMesh));
+        mesh.meshlets.resize(header->meshletCount);
+        if (!mesh.meshlets.empty())
+            memcpy(&mesh.meshlets[0], cachedPayload + mesh.subMeshes.size() * sizeof(GLSubMesh), mesh.meshlets.size() * sizeof(GLMeshlet));
+        vertexCount = header->vertexCount;
+        indexCount = header->indexCount;
+        mesh.compactVertices = header->compactVertices != 0;
+    }
+
+    // Welding, vertex cache optimization, compact encoding and caching need the whole mesh on the CPU, so with
+    // any of them on, which is the default, it is generated into a float copy. Only with all of them off is it
+    // generated straight into the mapped buffers
+    const bool processOnCpu = gCompactVertices || gWeldVertices || gOptimizeVertexCache || gCacheMeshes;
+    std::vector<float> floatVertices;
+    std::vector<GLuint> floatIndices;
+    if (processOnCpu && !cached)
+    {
+        floatVertices.resize(vertexCount * VERTEX_FLOATS);
+        floatIndices.resize(indexCount);
+        UGeneratePrimitives(primitives, mesh.subMeshes, &floatVertices[0], &floatIndices[0]);
+
+        // Welding shrinks the submeshes, so the totals are taken again afterwards
+        if (gWeldVertices)
+        {
+            UWeldMesh(mesh.subMeshes, floatVertices, floatIndices);
+            vertexCount = GLuint(floatVertices.size() / VERTEX_FLOATS);
+            indexCount = GLuint(floatIndices.size());
+        }
+
+        if (gOptimizeVertexCache)
+            UOptimizeMesh(mesh.subMeshes, &floatVertices[0], &floatIndices[0]);
+
+        // Clusters follow the final triangle order, so they are cut last
+        UBuildMeshlets(mesh.subMeshes, &floatVertices[0], &floatIndices[0], mesh.meshlets);
+    }
+
+    // Compact vertices need 16-bit indices, so every submesh must stay under 65536 vertices
+    if (!cached)
+    {
+        GLuint maxSubMeshVertexCount = 0;
+        for (size_t i = 0; i < mesh.subMeshes.size(); ++i)
+            maxSubMeshVertexCount = std::max(maxSubMeshVertexCount, mesh.subMeshes[i].vertexCount);
+        mesh.compactVertices = gCompactVertices && maxSubMeshVertexCount <= 65536;
+    }
+    mesh.indexType = mesh.compactVertices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    const GLsizei vertexSize = mesh.compactVertices ? sizeof(CompactVertex) : VERTEX_FLOATS * sizeof(float);
+    const GLsizeiptr vertexBytes = GLsizeiptr(vertexCount) * vertexSize;
+    const GLsizeiptr indexBytes = GLsizeiptr(indexCount) * (mesh.compactVertices ? sizeof(GLushort) : sizeof(GLuint));
+
+    // The mapped buffers are write-only, so the cache file cannot be written from them. Cold starts that write
+    // the cache encode the final buffers once into its payload and upload them with one copy from there,
+    // which is cheaper than encoding them twice; without the cache they are encoded straight into the mapping
+    const size_t subMeshBytes = mesh.subMeshes.size() * sizeof(GLSubMesh);
+    const size_t meshletBytes = mesh.meshlets.size() * sizeof(GLMeshlet);
+    const size_t tableBytes = subMeshBytes + meshletBytes;
+    std::vector<unsigned char> cachePayload;
+    if (gCacheMeshes && !cached)
+    {
+        cachePayload.resize(tableBytes + vertexBytes + indexBytes);
+        memcpy(&cachePayload[0], &mesh.subMeshes[0], subMeshBytes);
+        if (meshletBytes > 0)
+            memcpy(&cachePayload[subMeshBytes], &mesh.meshlets[0], meshletBytes);
+        unsigned char* vertexData = &cachePayload[tableBytes];
+        unsigned char* indexData = vertexData + vertexBytes;
+        if (mesh.compactVertices)
+        {
+            UEncodeCompactMesh(mesh.subMeshes, &floatVertices[0], &floatIndices[0], (CompactVertex*)vertexData, (GLushort*)indexData);
+        }
+        else
+        {
+            memcpy(vertexData, &floatVertices[0], vertexBytes);
+            memcpy(indexData, &floatIndices[0], indexBytes);
+        }
+
+        MeshCacheHeader header;
+        memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+        header.version = MESH_CACHE_VERSION;
+        header.compactVertices = mesh.compactVertices ? 1 : 0;
+        header.parameterHash = parameterHash;
+        header.subMeshCount = GLuint(mesh.subMeshes.size());
+        header.vertexCount = vertexCount;
+        header.indexCount = indexCount;
+        header.meshletCount = GLuint(mesh.meshlets.size());
+        header.vertexBytes = uint64_t(vertexBytes);
+        header.indexBytes = uint64_t(indexBytes);
+        UCreateCacheDirectory();
+        if (UWriteCacheFile(cachePath, &header, sizeof(header), &cachePayload[0], cachePayload.size()))
+            cout << "INFO: Mesh cache written to " << cachePath << endl;
+    }
+    const unsigned char* payload = cached ? cachedPayload : cachePayload.empty() ? NULL : &cachePayload[0];
+
+    // Generate VAO, VBO, and EBO
+    glGenVertexArrays(1, &mesh.vao);
+    glGenBuffers(1, &mesh.vbo);
+    glGenBuffers(1, &mesh.ebo);
+
+    glBindVertexArray(mesh.vao);
+
+    // Immutable storage mapped for writing lets the jobs write straight into the GL buffers;
+    // if the driver loses the mapped contents the upload is redone through staging copies
+    bool useBufferStorage = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    for (bool uploaded = false; !uploaded; useBufferStorage = false)
+    {
+        BufferWriter vertexWriter, indexWriter;
+        void* vertexData = UBeginBufferWrite(vertexWriter, GL_ARRAY_BUFFER, mesh.vbo, vertexBytes, useBufferStorage);
+        void* indexData = UBeginBufferWrite(indexWriter, GL_ELEMENT_ARRAY_BUFFER, mesh.ebo, indexBytes, useBufferStorage);
+
+        if (payload)
+        {
+            memcpy(vertexData, payload + tableBytes, vertexBytes);
+            memcpy(indexData, payload + tableBytes + vertexBytes, indexBytes);
+        }
+        else if (mesh.compactVertices)
+        {
+            UEncodeCompactMesh(mesh.subMeshes, &floatVertices[0], &floatIndices[0], (CompactVertex*)vertexData, (GLushort*)indexData);
+        }
+        else if (processOnCpu)
+        {
+            memcpy(vertexData, &floatVertices[0], vertexBytes);
+            memcpy(indexData, &floatIndices[0], indexBytes);
+        }
+        else
+        {
+            UGeneratePrimitives(primitives, mesh.subMeshes, (float*)vertexData, (GLuint*)indexData);
+        }
+
+        bool verticesUploaded = UEndBufferWrite(vertexWriter);
+        bool indicesUploaded = UEndBufferWrite(indexWriter);
+        uploaded = verticesUploaded && indicesUploaded;
+        if (!uploaded)
+        {
+            // Immutable storage cannot be respecified, so start over with fresh buffers
+            glDeleteBuffers(1, &mesh.vbo);
+            glDeleteBuffers(1, &mesh.ebo);
+            glGenBuffers(1, &mesh.vbo);
+            glGenBuffers(1, &mesh.ebo);
+        }
+    }
+
+    if (cached)
+        UUnmapFile(cachedMesh);
+    cout << "INFO: Mesh " << (cached ? "mapped from the cache" : "generated") << " in "
+         << int((glfwGetTime() - meshStartTime) * 1000.0) << " ms" << endl;
+
+    // The attribute pointers below read from the VBO bound here, and the EBO must stay bound to the VAO
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+
+    if (mesh.compactVertices)
+    {
+        // Position attribute: snorm16 relative to the submesh bounds
+        glVertexAttribPointer(0, 4, GL_SHORT, GL_TRUE, vertexSize, (void*)offsetof(CompactVertex, position));
+        // Normal attribute: snorm16 octahedral encoding
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, vertexSize, (void*)offsetof(CompactVertex, normal));
+        // Texture coordinate attribute: unorm16
+        glVertexAttribPointer(2, 2, GL_UNSIGNED_SHORT, GL_TRUE, vertexSize, (void*)offsetof(CompactVertex, texCoord));
+    }
+    else
+    {
+        // Position attribute
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertexSize, (void*)0);
+        // Normal attribute
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, vertexSize, (void*)(3 * sizeof(float)));
+        // Texture coordinate attribute
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, vertexSize, (void*)(6 * sizeof(float)));
+    }
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    // Draw data of every instance; the dequantization bounds come from its library mesh, and the
+    // matrices are filled in once the scene graph is updated
+    std::vector<GLDrawData>& drawData = mesh.drawData;
+    drawData.assign(mesh.instances.size(), GLDrawData());
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        const GLInstance& instance = mesh.instances[i];
+        const GLLodChain& chain = mesh.lodChains[instance.chain];
+        if (mesh.compactVertices)
+        {
+            drawData[i].boundsCenter = glm::vec4((chain.boundsMin + chain.boundsMax) * 0.5f, 0.0f);
+            drawData[i].boundsExtent = glm::vec4((chain.boundsMax - chain.boundsMin) * 0.5f, 0.0f);
+        }
+        else
+        {
+            // Float positions need no dequantization
+            drawData[i].boundsCenter = glm::vec4(0.0f);
+            drawData[i].boundsExtent = glm::vec4(1.0f);
+        }
+        drawData[i].model = glm::mat4(1.0f);
+        drawData[i].normalMatrix = glm::mat4(1.0f);
+        drawData[i].material = GLuint(instance.material);
+    }
+
+    // World-space culling spheres, padded to whole groups of four and filled in with the matrices
+    const size_t paddedInstanceCount = (mesh.instances.size() + 3) & ~size_t(3);
+    mesh.cullSpheres.x.assign(paddedInstanceCount, 0.0f);
+    mesh.cullSpheres.y.assign(paddedInstanceCount, 0.0f);
+    mesh.cullSpheres.z.assign(paddedInstanceCount, 0.0f);
+    mesh.cullSpheres.radius.assign(paddedInstanceCount, 0.0f);
+
+    // Instance buffer: each command's instances read their draw data index from consecutive entries,
+    // starting at the command's baseInstance
+    mesh.instanceIds.clear();
+    glGenBuffers(1, &mesh.drawIdBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.drawIdBuffer);
+    // The second half holds the shadow casters, so the shadow pass draws through the same vertex array
+    glBufferData(GL_ARRAY_BUFFER, 2 * mesh.instances.size() * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (void*)0);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
+
+    glGenBuffers(1, &mesh.drawDataBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh.drawDataBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, drawData.size() * sizeof(GLDrawData), &drawData[0], GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, mesh.drawDataBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // Unbind the VAO
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Save the total count of vertices and indices for rendering
+    mesh.nVertices = vertexCount;
+    mesh.nIndices = indexCount;
+    cout << "INFO: Mesh: " << vertexCount << " vertices, " << indexCount << " indices, "
+        << (vertexBytes + indexBytes) / 1024 << " KiB" << (mesh.compactVertices ? " (compact)" : "") << endl;
+
+    // Starts with room for one command per instance and grows when the meshlet ranges need more;
+    // rewritten whenever the draw list changes
+    mesh.commands.clear();
+    mesh.meshletCommands.clear();
+    mesh.commandCapacity = GLuint(mesh.instances.size());
+    mesh.culledObjects = 0;
+    mesh.culledMeshlets = 0;
+    mesh.testedMeshlets = 0;
+    mesh.culledMeshletTriangles = 0;
+    mesh.testedMeshletTriangles = 0;
+    glGenBuffers(1, &mesh.indirectBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, mesh.commandCapacity * sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // Shadow casters: every instance of a SHADOW_CASTER_MATERIALS material at its finest level, one command
+    // per chain. Nothing is culled against the camera, so the shadow maps stay valid from any viewpoint
+    std::vector<GLuint> casterIds;
+    mesh.shadowCommands.clear();
+    for (size_t chain = 0; chain < mesh.lodChains.size(); ++chain)
+    {
+        const GLuint firstCaster = GLuint(casterIds.size());
+        for (size_t i = 0; i < mesh.instances.size(); ++i)
+        {
+            const GLInstance& instance = mesh.instances[i];
+            if (instance.chain == chain && ((SHADOW_CASTER_MATERIALS >> instance.material) & 1) != 0)
+                casterIds.push_back(GLuint(i));
+        }
+        if (casterIds.size() == firstCaster)
+            continue;
+
+        const GLSubMesh& subMesh = mesh.subMeshes[mesh.lodChains[chain].firstSubMesh];
+        DrawElementsIndirectCommand command;
+        command.count = subMesh.indexCount;
+        command.instanceCount = GLuint(casterIds.size()) - firstCaster;
+        command.firstIndex = subMesh.firstIndex;
+        command.baseVertex = subMesh.baseVertex;
+        command.baseInstance = GLuint(mesh.instances.size()) + firstCaster;
+        mesh.shadowCommands.push_back(command);
+    }
+
+    mesh.shadowIndirectBuffer = 0;
+    if (!mesh.shadowCommands.empty())
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.drawIdBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, mesh.instances.size() * sizeof(GLuint), casterIds.size() * sizeof(GLuint), &casterIds[0]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glGenBuffers(1, &mesh.shadowIndirectBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.shadowIndirectBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, mesh.shadowCommands.size() * sizeof(DrawElementsIndirectCommand),
+            &mesh.shadowCommands[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+}
+
+
+// Moves every visible instance to the coarsest level whose silhouette edges stay short on screen
+void USelectLevelsOfDetail(GLMesh& mesh, const glm::mat4& view, const glm::mat4& projection)
+{
+    const GLCullSpheres& spheres = mesh.cullSpheres;
+    // Perspective projections divide by the distance; orthographic ones keep a fixed scale
+    const bool perspectiveProjection = projection[2][3] != 0.0f;
+    const float pixelsPerUnit = projection[1][1] * 0.5f * WINDOW_HEIGHT;
+
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        GLInstance& instance = mesh.instances[i];
+        const GLLodChain& chain = mesh.lodChains[instance.chain];
+        if (chain.levelCount == 1 || !instance.visible)
+            continue;
+
+        // Distance rather than depth, so turning the camera does not change the level
+        float diameter = 2.0f * spheres.radius[i] * pixelsPerUnit;
+        if (perspectiveProjection)
+            diameter /= std::max(glm::length(glm::vec3(view * glm::vec4(spheres.x[i], spheres.y[i], spheres.z[i], 1.0f))), 0.1f);
+        const float circumference = 3.14159265f * diameter;
+
+        GLuint level = instance.level;
+        while (level + 1 < chain.levelCount && circumference / chain.levelSectors[level + 1] < LOD_MAX_EDGE_PIXELS * (1.0f - LOD_HYSTERESIS))
+            ++level;
+        while (level > 0 && circumference / chain.levelSectors[level] > LOD_MAX_EDGE_PIXELS * (1.0f + LOD_HYSTERESIS))
+            --level;
+        instance.level = level;
+    }
+}
+
+
+// World-space frustum planes (a, b, c, d) from the rows of the view-projection matrix, pointing inwards
+// and normalized so that a point's plane equation is its distance
+void UExtractFrustumPlanes(const glm::mat4& view, const glm::mat4& projection, glm::vec4* planes)
+{
+    const glm::mat4 viewProjection = projection * view;
+    glm::vec4 rows[4];
+    for (int row = 0; row < 4; ++row)
+        rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+    planes[0] = rows[3] + rows[0];
+    planes[1] = rows[3] - rows[0];
+    planes[2] = rows[3] + rows[1];
+    planes[3] = rows[3] - rows[1];
+    planes[4] = rows[3] + rows[2];
+    planes[5] = rows[3] - rows[2];
+    for (int p = 0; p < 6; ++p)
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+}
+
+
+// Marks the instances whose bounds intersect the view frustum: bounding spheres are tested four at a time,
+// and the spheres that pass are refined against the tighter bounding box
+void UCullObjects(GLMesh& mesh, const SceneGraph& scene, const glm::mat4& view, const glm::mat4& projection)
+{
+    glm::vec4 planes[6];
+    UExtractFrustumPlanes(view, projection, planes);
+
+    // The world-space spheres are kept up to date by UUpdateObjectTransforms
+    const size_t instanceCount = mesh.instances.size();
+    const GLCullSpheres& spheres = mesh.cullSpheres;
+    const size_t paddedCount = spheres.x.size();
+
+    // A sphere is outside when it lies entirely behind any plane
+    std::vector<unsigned char> sphereVisible(paddedCount);
+#ifdef U_USE_SSE2
+    for (size_t i = 0; i < paddedCount; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&spheres.x[i]);
+        __m128 y = _mm_loadu_ps(&spheres.y[i]);
+        __m128 z = _mm_loadu_ps(&spheres.z[i]);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&spheres.radius[i]));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)), _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+                _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)), _mm_set1_ps(planes[p].w)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; ++lane)
+            sphereVisible[i + lane] = (mask >> lane) & 1;
+    }
+#else
+    for (size_t i = 0; i < paddedCount; ++i)
+    {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; ++p)
+            inside = planes[p].x * spheres.x[i] + planes[p].y * spheres.y[i] + planes[p].z * spheres.z[i] + planes[p].w >= -spheres.radius[i];
+        sphereVisible[i] = inside;
+    }
+#endif
+
+    // Box test for the survivors: the world-space box extent along a plane normal is |normal| . |model| * extent
+    GLuint culled = 0;
+    for (size_t i = 0; i < instanceCount; ++i)
+    {
+        GLInstance& instance = mesh.instances[i];
+        const GLLodChain& chain = mesh.lodChains[instance.chain];
+        instance.visible = sphereVisible[i] != 0;
+        if (instance.visible)
+        {
+            const glm::mat4& model = scene.world[instance.node];
+            const glm::mat3 absolute = glm::mat3(glm::abs(glm::vec3(model[0])), glm::abs(glm::vec3(model[1])), glm::abs(glm::vec3(model[2])));
+            glm::vec3 center = glm::vec3(model * glm::vec4((chain.boundsMin + chain.boundsMax) * 0.5f, 1.0f));
+            glm::vec3 extent = absolute * ((chain.boundsMax - chain.boundsMin) * 0.5f);
+            for (int p = 0; p < 6 && instance.visible; ++p)
+            {
+                glm::vec3 normal = glm::vec3(planes[p]);
+                instance.visible = glm::dot(normal, center) + planes[p].w >= -glm::dot(glm::abs(normal), extent);
+            }
+        }
+        if (!instance.visible)
+            ++culled;
+    }
+
+    mesh.culledObjects = culled;
+}
+
+
+// Tests the meshlets of every visible instance whose level has more than one against the frustum and,
+// for opaque closed surfaces, against the view direction; the survivors become index ranges of their
+// instance, merged where they follow each other in the index buffer
+void UCullMeshlets(GLMesh& mesh, const SceneGraph& scene, const glm::mat4& view, const glm::mat4& projection)
+{
+    glm::vec4 planes[6];
+    UExtractFrustumPlanes(view, projection, planes);
+    const glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+
+    mesh.meshletCommands.clear();
+    GLuint culled = 0, tested = 0, culledTriangles = 0, testedTriangles = 0;
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        GLInstance& instance = mesh.instances[i];
+        const GLLodChain& chain = mesh.lodChains[instance.chain];
+        const GLSubMesh& subMesh = mesh.subMeshes[chain.firstSubMesh + instance.level];
+        instance.clustered = gCullMeshlets && instance.visible && subMesh.meshletCount > 1;
+        if (!instance.clustered)
+            continue;
+
+        // Spheres grow by the largest axis scale; the normal cone only survives uniform scales, since
+        // other ones bend normals by different angles
+        const glm::mat4& model = scene.world[instance.node];
+        const glm::vec3 axisScales(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2])));
+        const float maxScale = std::max(axisScales.x, std::max(axisScales.y, axisScales.z));
+        const float minScale = std::min(axisScales.x, std::min(axisScales.y, axisScales.z));
+        const bool opaque = ((TRANSLUCENT_MATERIALS >> instance.material) & 1) == 0;
+        const bool coneCulling = chain.closed && opaque && maxScale - minScale <= maxScale * 1e-3f;
+        const glm::mat3 rotation = glm::mat3(model) / maxScale;
+
+        for (GLuint m = 0; m < subMesh.meshletCount; ++m)
+        {
+            const GLMeshlet& meshlet = mesh.meshlets[subMesh.firstMeshlet + m];
+            const glm::vec3 center = glm::vec3(model * glm::vec4(meshlet.center, 1.0f));
+            const float radius = meshlet.radius * maxScale;
+
+            bool visible = true;
+            for (int p = 0; p < 6 && visible; ++p)
+                visible = glm::dot(glm::vec3(planes[p]), center) + planes[p].w >= -radius;
+
+            // Every triangle faces away when the eye is outside the cone of directions from which one
+            // of them could be seen; the sphere makes it hold for any point of the meshlet
+            if (visible && coneCulling && meshlet.coneCutoff < 1.0f)
+            {
+                const glm::vec3 toCenter = center - eye;
+                visible = glm::dot(toCenter, rotation * meshlet.coneAxis) < meshlet.coneCutoff * glm::length(toCenter) + radius;
+            }
+
+            ++tested;
+            testedTriangles += meshlet.indexCount / 3;
+            if (!visible)
+            {
+                ++culled;
+                culledTriangles += meshlet.indexCount / 3;
+                continue;
+            }
+
+            DrawElementsIndirectCommand* last = mesh.meshletCommands.empty() ? NULL : &mesh.meshletCommands.back();
+            if (last && last->baseInstance == GLuint(i) && last->firstIndex + last->count == meshlet.firstIndex)
+            {
+                last->count += meshlet.indexCount;
+            }
+            else
+            {
+                DrawElementsIndirectCommand command;
+                command.count = meshlet.indexCount;
+                command.instanceCount = 1;
+                command.firstIndex = meshlet.firstIndex;
+                command.baseVertex = subMesh.baseVertex;
+                command.baseInstance = GLuint(i);   // Replaced by the instance's entry in the instance list
+                mesh.meshletCommands.push_back(command);
+            }
+        }
+    }
+
+    mesh.culledMeshlets = culled;
+    mesh.testedMeshlets = tested;
+    mesh.culledMeshletTriangles = culledTriangles;
+    mesh.testedMeshletTriangles = testedTriangles;
+}
+
+
+// Buckets the visible instances by library mesh and level; each bucket becomes one instanced command
+// whatever the materials of its instances. Uploads the instance list and the commands when they differ
+// from the last ones
+void UUpdateDrawCommands(GLMesh& mesh)
+{
+    const size_t chainCount = mesh.lodChains.size();
+    const size_t bucketCount = chainCount * LOD_LEVEL_COUNT;
+    auto bucketOf = [](const GLInstance& instance)
+    {
+        return instance.chain * LOD_LEVEL_COUNT + instance.level;
+    };
+
+    // Counting sort of the visible instances into their buckets; clustered ones bring their own ranges
+    std::vector<GLuint>& bucketStart = mesh.bucketStart;
+    bucketStart.assign(bucketCount + 1, 0);
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        if (mesh.instances[i].visible && !mesh.instances[i].clustered)
+            ++bucketStart[bucketOf(mesh.instances[i]) + 1];
+    }
+    for (size_t b = 0; b < bucketCount; ++b)
+        bucketStart[b + 1] += bucketStart[b];
+
+    std::vector<GLuint>& instanceIds = mesh.nextInstanceIds;
+    std::vector<GLuint>& fill = mesh.bucketFill;
+    instanceIds.resize(bucketStart[bucketCount]);
+    fill.assign(bucketStart.begin(), bucketStart.end() - 1);
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        if (mesh.instances[i].visible && !mesh.instances[i].clustered)
+            instanceIds[fill[bucketOf(mesh.instances[i])]++] = GLuint(i);
+    }
+
+    std::vector<DrawElementsIndirectCommand>& commands = mesh.nextCommands;
+    commands.clear();
+    for (size_t chain = 0; chain < chainCount; ++chain)
+    {
+        for (GLuint level = 0; level < mesh.lodChains[chain].levelCount; ++level)
+        {
+            const size_t bucket = chain * LOD_LEVEL_COUNT + level;
+            const GLuint instanceCount = bucketStart[bucket + 1] - bucketStart[bucket];
+            if (instanceCount == 0)
+                continue;
+
+            const GLSubMesh& subMesh = mesh.subMeshes[mesh.lodChains[chain].firstSubMesh + level];
+            DrawElementsIndirectCommand command;
+            command.count = subMesh.indexCount;
+            command.instanceCount = instanceCount;
+            command.firstIndex = subMesh.firstIndex;
+            command.baseVertex = subMesh.baseVertex;
+            command.baseInstance = bucketStart[bucket];  // First of the bucket's entries in the instance list
+            commands.push_back(command);
+        }
+    }
+
+    // Each clustered instance gets a single entry after the buckets, shared by all of its ranges
+    for (size_t i = 0; i < mesh.meshletCommands.size(); ++i)
+    {
+        DrawElementsIndirectCommand command = mesh.meshletCommands[i];
+        if (i == 0 || command.baseInstance != mesh.meshletCommands[i - 1].baseInstance)
+            instanceIds.push_back(command.baseInstance);
+        command.baseInstance = GLuint(instanceIds.size() - 1);
+        commands.push_back(command);
+    }
+
+    if (instanceIds != mesh.instanceIds)
+    {
+        mesh.instanceIds.swap(instanceIds);
+        if (!mesh.instanceIds.empty())
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.drawIdBuffer);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, mesh.instanceIds.size() * sizeof(GLuint), &mesh.instanceIds[0]);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+
+    bool changed = commands.size() != mesh.commands.size() ||
+        (!commands.empty() && memcmp(&commands[0], &mesh.commands[0], commands.size() * sizeof(DrawElementsIndirectCommand)) != 0);
+    if (changed)
+    {
+        mesh.commands.swap(commands);
+        if (mesh.commands.size() > mesh.commandCapacity)
+        {
+            // Doubles, so a camera sweeping over the dense meshes settles after a few reallocations
+            mesh.commandCapacity = std::max(GLuint(mesh.commands.size()), mesh.commandCapacity * 2);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirectBuffer);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, mesh.commandCapacity * sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+        if (!mesh.commands.empty())
+        {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.indirectBuffer);
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, mesh.commands.size() * sizeof(DrawElementsIndirectCommand), &mesh.commands[0]);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+    }
+}
+
+
+// Refreshes the draw data and culling sphere of every instance whose scene node moved, and uploads
+// the range of draw data that changed
+void UUpdateObjectTransforms(GLMesh& mesh, const SceneGraph& scene)
+{
+    if (!scene.hasChangedNodes)
+        return;
+
+    size_t firstChanged = mesh.instances.size();
+    size_t lastChanged = 0;
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        const GLInstance& instance = mesh.instances[i];
+        if (!scene.changed[instance.node])
+            continue;
+
+        const glm::mat4& model = scene.world[instance.node];
+        mesh.drawData[i].model = model;
+        mesh.drawData[i].normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(model))));
+
+        // The sphere encloses the transformed bounding box, which stays tight under non-uniform scales
+        const GLLodChain& chain = mesh.lodChains[instance.chain];
+        const glm::mat3 absolute = glm::mat3(glm::abs(glm::vec3(model[0])), glm::abs(glm::vec3(model[1])), glm::abs(glm::vec3(model[2])));
+        glm::vec3 center = glm::vec3(model * glm::vec4((chain.boundsMin + chain.boundsMax) * 0.5f, 1.0f));
+        glm::vec3 extent = absolute * ((chain.boundsMax - chain.boundsMin) * 0.5f);
+        mesh.cullSpheres.x[i] = center.x;
+        mesh.cullSpheres.y[i] = center.y;
+        mesh.cullSpheres.z[i] = center.z;
+        mesh.cullSpheres.radius[i] = glm::length(extent);
+
+        firstChanged = std::min(firstChanged, i);
+        lastChanged = i;
+    }
+
+    if (firstChanged <= lastChanged)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, mesh.drawDataBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, firstChanged * sizeof(GLDrawData),
+            (lastChanged - firstChanged + 1) * sizeof(GLDrawData), &mesh.drawData[firstChanged]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+}
+
+
+// Appends a node to the scene graph; the parent must already exist, which keeps parents ahead of their children
+GLuint UAddSceneNode(SceneGraph& scene, GLint parent, const glm::mat4& local)
+{
+    GLuint node = GLuint(scene.local.size());
+    scene.parent.push_back(parent);
+    scene.local.push_back(local);
+    scene.world.push_back(local);
+    scene.dirty.push_back(1);
+    scene.changed.push_back(0);
+    scene.hasDirtyNodes = true;
+    return node;
+}
+
+
+// Replaces the transform of a node relative to its parent; the node and its subtree update on the next frame
+void USetLocalTransform(SceneGraph& scene, GLuint node, const glm::mat4& local)
+{
+    scene.local[node] = local;
+    scene.dirty[node] = 1;
+    scene.hasDirtyNodes = true;
+}
+
+
+// Recomputes the world matrix of every dirty node and of everything below it in one forward pass;
+// a frame with no edits touches no matrices
+void UUpdateWorldTransforms(SceneGraph& scene)
+{
+    if (!scene.hasDirtyNodes)
+    {
+        // Clears the flags left by the last update so nothing is re-uploaded
+        if (scene.hasChangedNodes)
+        {
+            std::fill(scene.changed.begin(), scene.changed.end(), 0);
+            scene.hasChangedNodes = false;
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < scene.local.size(); ++i)
+    {
+        const GLint parent = scene.parent[i];
+        const bool update = scene.dirty[i] || (parent >= 0 && scene.changed[parent]);
+        scene.changed[i] = update;
+        if (!update)
+            continue;
+
+        scene.world[i] = parent >= 0 ? scene.world[parent] * scene.local[i] : scene.local[i];
+        scene.dirty[i] = 0;
+    }
+    scene.hasDirtyNodes = false;
+    scene.hasChangedNodes = true;
+}
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(1, &mesh.vbo);
+    glDeleteBuffers(1, &mesh.ebo);
+    glDeleteBuffers(1, &mesh.indirectBuffer);
+    glDeleteBuffers(1, &mesh.shadowIndirectBuffer);
+    glDeleteBuffers(1, &mesh.drawIdBuffer);
+    glDeleteBuffers(1, &mesh.drawDataBuffer);
+}
+
+
+// Bilinear resampling of an RGBA image to a square size x size image
+void UResampleImage(const unsigned char* source, int sourceWidth, int sourceHeight, unsigned char* destination, int size)
+{
+    const float scaleX = (float)sourceWidth / size;
+    const float scaleY = (float)sourceHeight / size;
+    for (int y = 0; y < size; ++y)
+    {
+        // Sample positions are pixel centers mapped back to the source
+        float sy = std::min(std::max((y + 0.5f) * scaleY - 0.5f, 0.0f), sourceHeight - 1.0f);
+        int y0 = (int)sy;
+        int y1 = std::min(y0 + 1, sourceHeight - 1);
+        float fy = sy - y0;
+        for (int x = 0; x < size; ++x)
+        {
+            float sx = std::min(std::max((x + 0.5f) * scaleX - 0.5f, 0.0f), sourceWidth - 1.0f);
+            int x0 = (int)sx;
+            int x1 = std::min(x0 + 1, sourceWidth - 1);
+            float fx = sx - x0;
+            for (int c = 0; c < 4; ++c)
+            {
+                float top = source[(y0 * sourceWidth + x0) * 4 + c] * (1.0f - fx) + source[(y0 * sourceWidth + x1) * 4 + c] * fx;
+                float bottom = source[(y1 * sourceWidth + x0) * 4 + c] * (1.0f - fx) + source[(y1 * sourceWidth + x1) * 4 + c] * fx;
+                destination[(y * size + x) * 4 + c] = (unsigned char)(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
+
+
+// Fills the levels after the first one with 2x2 box filtered copies of the previous level. Levels are
+// square powers of two packed one after the other
+void UBuildMipChain(unsigned char* pixels, int size, int levelCount)
+{
+    const unsigned char* source = pixels;
+    unsigned char* destination = pixels;
+    for (int level = 1; level < levelCount; ++level)
+    {
+        const int sourceSize = size >> (level - 1);
+        destination += size_t(sourceSize) * sourceSize * 4;
+        gImageKernels.downsample(source, sourceSize, destination);
+        source = destination;
+    }
+}
+
+
+// Bytes of one level; block compressed levels are padded to whole 4x4 blocks
+size_t UTextureLevelBytes(GLenum format, int size)
+{
+    if (format == GL_RGBA8)
+        return size_t(size) * size * 4;
+
+    const size_t blocks = size_t((size + 3) / 4) * ((size + 3) / 4);
+    return blocks * (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+}
+
+
+// Expands a 5:6:5 color the way the hardware does
+void UUnpackColor565(unsigned int color, int* rgb)
+{
+    rgb[0] = ((color >> 11) & 31) * 255 / 31;
+    rgb[1] = ((color >> 5) & 63) * 255 / 63;
+    rgb[2] = (color & 31) * 255 / 31;
+}
+
+
+// Four entry palette of a color block; BC3 color blocks always use the four color mode
+void UColorPalette(unsigned int color0, unsigned int color1, int palette[4][3])
+{
+    UUnpackColor565(color0, palette[0]);
+    UUnpackColor565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+}
+
+
+// Eight entry palette of a BC3 alpha block in the interpolated mode, which the encoder always selects
+void UAlphaPalette(int alpha0, int alpha1, int palette[8])
+{
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    for (int i = 1; i <= 6; ++i)
+        palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+}
+
+
+// BC1 color block of 16 RGBA pixels in row order. The endpoints span the pixels along their principal
+// axis, pulled in by a sixteenth of the range, and each pixel takes the nearest palette entry
+void UEncodeColorBlock(const unsigned char* pixels, unsigned char* block)
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+            mean[c] += pixels[i * 4 + c] / 16.0f;
+    }
+
+    float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };   // rr, rg, rb, gg, gb, bb
+    for (int i = 0; i < 16; ++i)
+    {
+        const float r = pixels[i * 4] - mean[0], g = pixels[i * 4 + 1] - mean[1], b = pixels[i * 4 + 2] - mean[2];
+        covariance[0] += r * r;
+        covariance[1] += r * g;
+        covariance[2] += r * b;
+        covariance[3] += g * g;
+        covariance[4] += g * b;
+        covariance[5] += b * b;
+    }
+
+    // A few power iterations are enough to pick the axis of a 4x4 block
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        const float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+        const float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+        const float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+        const float length = std::max(std::max(fabsf(x), fabsf(y)), fabsf(z));
+        if (length <= 0.0f)
+            break;
+        axis[0] = x / length;
+        axis[1] = y / length;
+        axis[2] = z / length;
+    }
+    const float axisLength = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    for (int c = 0; c < 3; ++c)
+        axis[c] /= axisLength;
+
+    float minimum = 0.0f, maximum = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float t = 0.0f;
+        for (int c = 0; c < 3; ++c)
+            t += (pixels[i * 4 + c] - mean[c]) * axis[c];
+        minimum = std::min(minimum, t);
+        maximum = std::max(maximum, t);
+    }
+    const float inset = (maximum - minimum) / 16.0f;
+    minimum += inset;
+    maximum -= inset;
+
+    unsigned int endpoints[2];
+    for (int e = 0; e < 2; ++e)
+    {
+        const float t = e == 0 ? maximum : minimum;
+        int rgb[3];
+        for (int c = 0; c < 3; ++c)
+            rgb[c] = std::min(std::max(int(mean[c] + axis[c] * t + 0.5f), 0), 255);
+        endpoints[e] = ((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255);
+    }
+    // The four color mode needs color0 > color1
+    if (endpoints[0] < endpoints[1])
+        std::swap(endpoints[0], endpoints[1]);
+
+    unsigned int indices = 0;
+    if (endpoints[0] != endpoints[1])
+    {
+        int palette[4][3];
+        UColorPalette(endpoints[0], endpoints[1], palette);
+        for (int i = 0; i < 16; ++i)
+        {
+            unsigned int best = 0;
+            int bestError = INT_MAX;
+            for (unsigned int entry = 0; entry < 4; ++entry)
+            {
+                int error = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    const int difference = pixels[i * 4 + c] - palette[entry][c];
+                    error += difference * difference;
+                }
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = entry;
+                }
+            }
+            indices |= best << (2 * i);
+        }
+    }
+
+    block[0] = (unsigned char)endpoints[0];
+    block[1] = (unsigned char)(endpoints[0] >> 8);
+    block[2] = (unsigned char)endpoints[1];
+    block[3] = (unsigned char)(endpoints[1] >> 8);
+    for (int i = 0; i < 4; ++i)
+        block[4 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+
+// BC3 alpha block of 16 RGBA pixels: the alpha range as endpoints, 3-bit nearest indices
+void UEncodeAlphaBlock(const unsigned char* pixels, unsigned char* block)
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        alpha0 = std::max(alpha0, int(pixels[i * 4 + 3]));
+        alpha1 = std::min(alpha1, int(pixels[i * 4 + 3]));
+    }
+
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        int palette[8];
+        UAlphaPalette(alpha0, alpha1, palette);
+        for (int i = 0; i < 16; ++i)
+        {
+            uint64_t best = 0;
+            int bestError = INT_MAX;
+            for (int entry = 0; entry < 8; ++entry)
+            {
+                const int error = abs(pixels[i * 4 + 3] - palette[entry]);
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = uint64_t(entry);
+                }
+            }
+            indices |= best << (3 * i);
+        }
+    }
+
+    block[0] = (unsigned char)alpha0;
+    block[1] = (unsigned char)alpha1;
+    for (int i = 0; i < 6; ++i)
+        block[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+
+// Encodes a square RGBA level block by block, repeating the edge pixels of levels smaller than a block
+void UCompressImage(const unsigned char* pixels, int size, GLenum format, unsigned char* destination)
+{
+    const int blocksPerRow = (size + 3) / 4;
+    unsigned char tile[16 * 4];
+    for (int by = 0; by < blocksPerRow; ++by)
+    {
+        for (int bx = 0; bx < blocksPerRow; ++bx)
+        {
+            for (int y = 0; y < 4; ++y)
+            {
+                for (int x = 0; x < 4; ++x)
+                {
+                    const int sx = std::min(bx * 4 + x, size - 1);
+                    const int sy = std::min(by * 4 + y, size - 1);
+                    memcpy(tile + (y * 4 + x) * 4, pixels + (size_t(sy) * size + sx) * 4, 4);
+                }
+            }
+
+            if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+            {
+                UEncodeAlphaBlock(tile, destination);
+                destination += 8;
+            }
+            UEncodeColorBlock(tile, destination);
+            destination += 8;
+        }
+    }
+}
+
+
+// Decodes a square BC1/BC3 level to RGBA, for measuring the encoder
+void UDecompressImage(const unsigned char* blocks, int size, GLenum format, unsigned char* destination)
+{
+    const int blocksPerRow = (size + 3) / 4;
+    for (int by = 0; by < blocksPerRow; ++by)
+    {
+        for (int bx = 0; bx < blocksPerRow; ++bx)
+        {
+            int alphas[16];
+            for (int i = 0; i < 16; ++i)
+                alphas[i] = 255;
+            if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+            {
+                int palette[8];
+                UAlphaPalette(blocks[0], blocks[1], palette);
+                uint64_t indices = 0;
+                for (int i = 0; i < 6; ++i)
+                    indices |= uint64_t(blocks[2 + i]) << (8 * i);
+                for (int i = 0; i < 16; ++i)
+                    alphas[i] = palette[(indices >> (3 * i)) & 7];
+                blocks += 8;
+            }
+
+            int palette[4][3];
+            UColorPalette(blocks[0] | blocks[1] << 8, blocks[2] | blocks[3] << 8, palette);
+            const unsigned int indices = blocks[4] | blocks[5] << 8 | blocks[6] << 16 | unsigned(blocks[7]) << 24;
+            blocks += 8;
+
+            for (int i = 0; i < 16; ++i)
+            {
+                const int x = bx * 4 + i % 4;
+                const int y = by * 4 + i / 4;
+                if (x >= size || y >= size)
+                    continue;
+                unsigned char* pixel = destination + (size_t(y) * size + x) * 4;
+                const int* color = palette[(indices >> (2 * i)) & 3];
+                pixel[0] = (unsigned char)color[0];
+                pixel[1] = (unsigned char)color[1];
+                pixel[2] = (unsigned char)color[2];
+                pixel[3] = (unsigned char)alphas[i];
+            }
+        }
+    }
+}
+
+
+// Peak signal to noise ratio over the first channels of RGBA pixels, in dB
+float UMeasurePSNR(const unsigned char* reference, const unsigned char* pixels, size_t pixelCount, int channels)
+{
+    double squaredError = 0.0;
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            const double difference = double(reference[i * 4 + c]) - pixels[i * 4 + c];
+            squaredError += difference * difference;
+        }
+    }
+    if (squaredError == 0.0)
+        return 99.0f;
+    const double meanSquaredError = squaredError / (double(pixelCount) * channels);
+    return float(10.0 * log10(255.0 * 255.0 / meanSquaredError));
+}
+
+
+// CPU-only check of the block encoder, run with --check-textures: encodes each image the way the
+// texture array would, decodes it again and fails when the PSNR drops below TEXTURE_MIN_PSNR
+bool UCheckTextureCompression(const char* const* filenames, int count)
+{
+    bool passed = true;
+    for (int i = 0; i < count; ++i)
+    {
+        int width, height, channels;
+        unsigned char* image = stbi_load(filenames[i], &width, &height, &channels, 4);
+        if (!image)
+        {
+            cout << "Failed to load texture " << filenames[i] << endl;
+            passed = false;
+            continue;
+        }
+
+        int size = 1;
+        while (size < std::max(width, height) && size < TEXTURE_ARRAY_MAX_SIZE)
+            size *= 2;
+        const size_t pixelCount = size_t(size) * size;
+        std::vector<unsigned char> pixels(pixelCount * 4);
+        UResampleImage(image, width, height, &pixels[0], size);
+        const bool translucent = UHasTranslucentAlpha(image, size_t(width) * height, 4);
+        stbi_image_free(image);
+
+        const GLenum format = translucent ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        std::vector<unsigned char> blocks(UTextureLevelBytes(format, size));
+        std::vector<unsigned char> decoded(pixelCount * 4);
+        UCompressImage(&pixels[0], size, format, &blocks[0]);
+        UDecompressImage(&blocks[0], size, format, &decoded[0]);
+        const float psnr = UMeasurePSNR(&pixels[0], &decoded[0], pixelCount, translucent ? 4 : 3);
+        const bool good = psnr >= TEXTURE_MIN_PSNR;
+        cout << (good ? "INFO: " : "FAILED: ") << filenames[i] << " " << size << "x" << size << " "
+             << (translucent ? "BC3" : "BC1") << " PSNR " << psnr << " dB" << endl;
+        passed = passed && good;
+    }
+    return passed;
+}
+
+
+// Picks the image kernels once at startup: SSE2 is part of every build that defines U_USE_SSE2,
+// SSSE3 is checked with cpuid
+void USelectImageKernels()
+{
+    gImageKernels.expandToRGBA = UExpandToRGBAScalar;
+    gImageKernels.premultiplyAlpha = UPremultiplyAlphaScalar;
+    gImageKernels.downsample = UDownsampleScalar;
+    gImageKernels.name = "scalar";
+#ifdef U_USE_SSE2
+    gImageKernels.premultiplyAlpha = UPremultiplyAlphaSSE2;
+    gImageKernels.downsample = UDownsampleSSE2;
+    gImageKernels.name = "SSE2";
+
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool hasSSSE3 = (info[2] & (1 << 9)) != 0;
+#else
+    const bool hasSSSE3 = __builtin_cpu_supports("ssse3") != 0;
+#endif
+    if (hasSSSE3)
+    {
+        gImageKernels.expandToRGBA = UExpandToRGBASSSE3;
+        gImageKernels.name = "SSSE3";
+    }
+#endif
+    cout << "INFO: Image kernels: " << gImageKernels.name << endl;
+}
+
+
+void UExpandToRGBAScalar(const unsigned char* source, int channels, unsigned char* destination, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i, source += channels, destination += 4)
+    {
+        const unsigned char grey = source[0];
+        destination[0] = grey;
+        destination[1] = channels >= 3 ? source[1] : grey;
+        destination[2] = channels >= 3 ? source[2] : grey;
+        destination[3] = channels == 2 ? source[1] : channels == 4 ? source[3] : 255;
+    }
+}
+
+
+// c * a / 255 rounded, without a division
+void UPremultiplyAlphaScalar(unsigned char* pixels, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i, pixels += 4)
+    {
+        const unsigned int alpha = pixels[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const unsigned int product = pixels[c] * alpha + 128;
+            pixels[c] = (unsigned char)((product + (product >> 8)) >> 8);
+        }
+    }
+}
+
+
+void UDownsampleScalar(const unsigned char* source, int sourceSize, unsigned char* destination)
+{
+    const int size = std::max(sourceSize / 2, 1);
+    for (int y = 0; y < size; ++y)
+    {
+        const unsigned char* row0 = source + size_t(2 * y) * sourceSize * 4;
+        const unsigned char* row1 = sourceSize > 1 ? row0 + size_t(sourceSize) * 4 : row0;
+        for (int x = 0; x < size; ++x)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                const int sum = row0[8 * x + c] + row0[8 * x + 4 + c] + row1[8 * x + c] + row1[8 * x + 4 + c];
+                destination[(size_t(y) * size + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+#ifdef U_USE_SSE2
+// Four pixels per shuffle; the scalar kernel finishes the pixels a 16-byte load could overrun
+U_TARGET_SSSE3 void UExpandToRGBASSSE3(const unsigned char* source, int channels, unsigned char* destination, size_t pixelCount)
+{
+    if (channels == 4)
+    {
+        memcpy(destination, source, pixelCount * 4);
+        return;
+    }
+
+    // -1 zeroes the byte, which the alpha mask then fills with 255
+    __m128i shuffle, alpha;
+    if (channels == 1)
+    {
+        shuffle = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+        alpha = _mm_set1_epi32(int(0xFF000000));
+    }
+    else if (channels == 2)
+    {
+        shuffle = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+        alpha = _mm_setzero_si128();
+    }
+    else
+    {
+        shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        alpha = _mm_set1_epi32(int(0xFF000000));
+    }
+
+    size_t i = 0;
+    for (; i * channels + 16 <= pixelCount * channels; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(source + i * channels));
+        _mm_storeu_si128((__m128i*)(destination + i * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+    }
+    UExpandToRGBAScalar(source + i * channels, channels, destination + i * 4, pixelCount - i);
+}
+
+
+// Four pixels per iteration, two in each half of 16-bit lanes, with the same rounding as the scalar kernel
+void UPremultiplyAlphaSSE2(unsigned char* pixels, size_t pixelCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i alphaMask = _mm_set1_epi32(int(0xFF000000));
+    size_t i = 0;
+    for (; i + 4 <= pixelCount; i += 4)
+    {
+        __m128i source = _mm_loadu_si128((const __m128i*)(pixels + i * 4));
+        __m128i result[2];
+        for (int part = 0; part < 2; ++part)
+        {
+            __m128i wide = part == 0 ? _mm_unpacklo_epi8(source, zero) : _mm_unpackhi_epi8(source, zero);
+            __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(wide, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            __m128i product = _mm_add_epi16(_mm_mullo_epi16(wide, alpha), half);
+            result[part] = _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+        }
+        __m128i packed = _mm_packus_epi16(result[0], result[1]);
+        packed = _mm_or_si128(_mm_andnot_si128(alphaMask, packed), _mm_and_si128(alphaMask, source));
+        _mm_storeu_si128((__m128i*)(pixels + i * 4), packed);
+    }
+    UPremultiplyAlphaScalar(pixels + i * 4, pixelCount - i);
+}
+
+
+// Two destination pixels per iteration: four source pixels of each row summed in 16-bit lanes
+void UDownsampleSSE2(const unsigned char* source, int sourceSize, unsigned char* destination)
+{
+    const int size = sourceSize / 2;
+    if (size < 2)
+    {
+        UDownsampleScalar(source, sourceSize, destination);
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    for (int y = 0; y < size; ++y)
+    {
+        const unsigned char* row0 = source + size_t(2 * y) * sourceSize * 4;
+        const unsigned char* row1 = row0 + size_t(sourceSize) * 4;
+        unsigned char* output = destination + size_t(y) * size * 4;
+        for (int x = 0; x < size; x += 2)
+        {
+            __m128i top = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+            __m128i bottom = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+            __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+            __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+            __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+            __m128i average = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+            _mm_storel_epi64((__m128i*)(output + x * 4), _mm_packus_epi16(average, zero));
+        }
+    }
+}
+#endif
+
+
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * FNV64_PRIME;
+    return hash;
+}
+
+
+bool UReadFile(const std::string& path, std::vector<unsigned char>& contents)
+{
+    std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+
+    contents.resize(size_t(file.tellg()));
+    file.seekg(0);
+    return contents.empty() || bool(file.read((char*)&contents[0], contents.size()));
+}
+
+
+// Writes a header and its payload to a temporary file and moves it into place, replacing a stale entry
+// of the same name, so a reader never maps a partially written file. The last writer of an entry wins
+bool UWriteCacheFile(const std::string& path, const void* header, size_t headerSize, const void* data, size_t dataSize)
+{
+    const std::string temporaryPath = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    {
+        std::ofstream file(temporaryPath.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+        file.write((const char*)header, headerSize);
+        file.write((const char*)data, dataSize);
+        if (!file)
+        {
+            file.close();
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+
+#ifdef _WIN32
+    // rename fails on Windows when the target exists
+    const bool moved = MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool moved = std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+#endif
+    if (!moved)
+    {
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool UMapFile(const std::string& path, MappedFile& file)
+{
+    file.data = NULL;
+    file.size = 0;
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping)
+    {
+        file.data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        file.size = file.data ? size_t(size.QuadPart) : 0;
+        CloseHandle(mapping);   // The view keeps the mapping alive
+    }
+    CloseHandle(handle);
+#else
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+    {
+        void* data = mmap(NULL, size_t(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (data != MAP_FAILED)
+        {
+            file.data = (const unsigned char*)data;
+            file.size = size_t(status.st_size);
+        }
+    }
+    close(descriptor);          // The mapping keeps the file open
+#endif
+    return file.data != NULL;
+}
+
+
+void UUnmapFile(MappedFile& file)
+{
+    if (!file.data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+#else
+    munmap((void*)file.data, file.size);
+#endif
+    file.data = NULL;
+    file.size = 0;
+}
+
+
+// Creates the cache directory if it is missing; its parent must exist
+void UCreateCacheDirectory()
+{
+#ifdef _WIN32
+    _mkdir(CACHE_DIRECTORY);
+#else
+    mkdir(CACHE_DIRECTORY, 0755);
+#endif
+}
+
+
+// Starts loading several textures into the layers of one GL_TEXTURE_2D_ARRAY. Only the image headers
+// are read here; the layers are allocated and cleared to a placeholder color, and the mip chains are
+// read from the texture cache or decoded on the thread pool straight into a mapped unpack buffer.
+// Layers share a size, so every image is resampled to the smallest power of two covering the largest one
+bool UBeginTextureArrayLoad(TextureArrayLoad& load, const char* const* filenames, int layerCount, unsigned int premultipliedLayers, GLuint& textureId)
+{
+    load.startTime = glfwGetTime();
+    load.layerCount = layerCount;
+    load.premultipliedLayers = premultipliedLayers;
+    load.pendingLayers = layerCount;
+    load.filenames.assign(filenames, filenames + layerCount);
+    load.layerStates.reset(new std::atomic<int>[layerCount]);
+    load.layerPSNR.assign(layerCount, 0.0f);
+    if (layerCount > TEXTURE_ARRAY_MAX_LAYERS)
+    {
+        cout << "Too many texture layers: " << layerCount << endl;
+        return false;
+    }
+
+    int largest = 1;
+    for (int layer = 0; layer < layerCount; ++layer)
+    {
+        int width, height, channels;
+        if (!stbi_info(filenames[layer], &width, &height, &channels))
+        {
+            cout << "Failed to load texture " << filenames[layer] << endl;
+            return false;
+        }
+        largest = std::max(largest, std::max(width, height));
+        load.layerStates[layer] = TEXTURE_LAYER_DECODING;
+    }
+
+    load.size = 1;
+    while (load.size < largest && load.size < TEXTURE_ARRAY_MAX_SIZE)
+        load.size *= 2;
+    load.levelCount = 1;
+    while ((load.size >> load.levelCount) > 0)
+        ++load.levelCount;
+
+    // Created here so the workers never race to create it
+    UCreateCacheDirectory();
+
+    // The format follows the sources' alpha, which the cache files remember; only layers missing
+    // from the cache are decoded for it, in parallel
+    load.translucentLayers = 0;
+    load.layerHashes.assign(layerCount, 0);
+    load.cachePaths.assign(layerCount, std::string());
+    std::vector<unsigned char> translucent(layerCount, 0);
+    for (int layer = 0; layer < layerCount; ++layer)
+    {
+        TextureArrayLoad* target = &load;
+        unsigned char* result = &translucent[layer];
+        gThreadPool.Submit([target, layer, result]()
+        {
+            bool hasAlpha = false;
+            *result = UProbeTextureLayer(*target, layer, hasAlpha) && hasAlpha;
+        }, JOB_GROUP_TEXTURES);
+    }
+    gThreadPool.Wait(JOB_GROUP_TEXTURES);
+    for (int layer = 0; layer < layerCount; ++layer)
+        load.translucentLayers |= unsigned(translucent[layer]) << layer;
+
+    // Layers share a format, so a single layer with alpha below 255 makes the whole array BC3
+    load.format = GL_RGBA8;
+    if (gCompressTextures && GLEW_EXT_texture_compression_s3tc)
+        load.format = load.translucentLayers ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    load.layerBytes = 0;
+    load.levelOffsets.resize(load.levelCount);
+    for (int level = 0; level < load.levelCount; ++level)
+    {
+        load.levelOffsets[level] = load.layerBytes;
+        load.layerBytes += UTextureLevelBytes(load.format, load.size >> level);
+    }
+    load.residentLevels.assign(layerCount, load.levelCount);
+    load.wantedLevels.assign(layerCount, load.levelCount - 1);
+    load.minLods.assign(layerCount, float(load.levelCount - 1));
+    load.residentBytes = 0;
+    load.loggedResidentBytes = 0;
+    load.cacheFiles.assign(layerCount, MappedFile{ NULL, 0 });
+    load.keepUploadBuffer = false;
+    cout << "INFO: Texture array of " << layerCount << " layers, " << load.size << "x" << load.size << ", "
+         << (load.layerBytes * layerCount) / 1024 << " KB of "
+         << (load.format == GL_RGBA8 ? "RGBA8" : load.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? "BC1" : "BC3") << endl;
+
     glGenTextures(1, &textureId);
+    load.texture = textureId;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+
+    // Sets the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Sets texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // Sparse storage gives the memory of evicted levels back; without it eviction only stops sampling them
+    load.sparse = false;
+    load.sparseLevels = 0;
+    if (GLEW_ARB_sparse_texture)
+    {
+        GLint pageSizeCount = 0, pageWidth = 0, pageHeight = 0, pageDepth = 0;
+        glGetInternalformativ(GL_TEXTURE_2D_ARRAY, load.format, GL_NUM_VIRTUAL_PAGE_SIZES_ARB, 1, &pageSizeCount);
+        if (pageSizeCount > 0)
+        {
+            glGetInternalformativ(GL_TEXTURE_2D_ARRAY, load.format, GL_VIRTUAL_PAGE_SIZE_X_ARB, 1, &pageWidth);
+            glGetInternalformativ(GL_TEXTURE_2D_ARRAY, load.format, GL_VIRTUAL_PAGE_SIZE_Y_ARB, 1, &pageHeight);
+            glGetInternalformativ(GL_TEXTURE_2D_ARRAY, load.format, GL_VIRTUAL_PAGE_SIZE_Z_ARB, 1, &pageDepth);
+            load.sparse = pageDepth == 1 && pageWidth > 0 && pageWidth <= load.size && pageHeight > 0 && pageHeight <= load.size;
+        }
+    }
+    if (load.sparse)
+    {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, 0);
+    }
+
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, load.levelCount, load.format, load.size, load.size, layerCount);
+
+    // The mip tail stays committed, so the placeholder only goes there
+    if (load.sparse)
+    {
+        glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_NUM_SPARSE_LEVELS_ARB, &load.sparseLevels);
+        load.sparseLevels = std::min(load.sparseLevels, GLint(load.levelCount));
+        if (load.sparseLevels < load.levelCount)
+        {
+            const GLsizei tailSize = load.size >> load.sparseLevels;
+            glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, load.sparseLevels, 0, 0, 0, tailSize, tailSize, layerCount, GL_TRUE);
+        }
+    }
+    if (load.format == GL_RGBA8)
+    {
+        for (GLint level = load.sparseLevels; level < load.levelCount; ++level)
+            glClearTexImage(textureId, level, GL_RGBA, GL_UNSIGNED_BYTE, TEXTURE_PLACEHOLDER_COLOR);
+    }
+    else
+    {
+        // Compressed textures cannot be cleared, so every block of every level is uploaded instead
+        unsigned char placeholder[4 * 4 * 4];
+        for (int i = 0; i < 4 * 4; ++i)
+            memcpy(placeholder + i * 4, TEXTURE_PLACEHOLDER_COLOR, 4);
+        const size_t blockBytes = UTextureLevelBytes(load.format, 1);
+        unsigned char block[16];
+        UCompressImage(placeholder, 4, load.format, block);
+        std::vector<unsigned char> blocks;
+        for (GLint level = load.sparseLevels; level < load.levelCount; ++level)
+        {
+            const GLsizei levelSize = load.size >> level;
+            const size_t levelBytes = UTextureLevelBytes(load.format, levelSize) * layerCount;
+            for (size_t offset = blocks.size(); offset < levelBytes; offset += blockBytes)
+                blocks.insert(blocks.end(), block, block + blockBytes);
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, 0, levelSize, levelSize, layerCount,
+                load.format, GLsizei(levelBytes), &blocks[0]);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
+
+    // Workers write the layers through a persistent mapping; the GL thread flushes each one before uploading it
+    const GLsizeiptr bufferSize = GLsizeiptr(load.layerBytes * layerCount);
+    glGenBuffers(1, &load.pixelBuffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, load.pixelBuffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bufferSize, NULL, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
+    load.pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bufferSize,
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_FLUSH_EXPLICIT_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!load.pixels)
+    {
+        glDeleteBuffers(1, &load.pixelBuffer);
+        load.pixelBuffer = 0;
+        load.staging.resize(load.layerBytes * layerCount);
+        load.pixels = &load.staging[0];
+    }
+
+    for (int layer = 0; layer < layerCount; ++layer)
+    {
+        TextureArrayLoad* target = &load;
+        gThreadPool.Submit([target, layer]()
+        {
+            bool cacheHit = false;
+            int state = TEXTURE_LAYER_FAILED;
+            if (ULoadTextureLayer(*target, layer, target->pixels + target->layerBytes * layer, cacheHit))
+                state = cacheHit ? TEXTURE_LAYER_CACHED : TEXTURE_LAYER_DECODED;
+            target->layerStates[layer].store(state, std::memory_order_release);
+        }, JOB_GROUP_TEXTURES);
+    }
+    return true;
+}
+
+
+// Hashes the source of a layer to name its cache file, and finds whether the source has alpha below
+// 255: from the cache file's header on warm starts, by decoding the source otherwise
+bool UProbeTextureLayer(TextureArrayLoad& load, int layer, bool& translucent)
+{
+    std::vector<unsigned char> source;
+    if (!UReadFile(load.filenames[layer], source) || source.empty())
+        return false;
+
+    // The same image resampled to another layer size or premultiplied is another entry; the format
+    // follows from the other layers, so it is only checked against the header
+    const unsigned char premultiply = (load.premultipliedLayers >> layer) & 1;
+    uint64_t hash = UHashBytes(&source[0], source.size(), FNV64_OFFSET_BASIS);
+    hash = UHashBytes(&load.size, sizeof(load.size), hash);
+    hash = UHashBytes(&premultiply, sizeof(premultiply), hash);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.utex", (unsigned long long)hash);
+    load.layerHashes[layer] = hash;
+    load.cachePaths[layer] = std::string(CACHE_DIRECTORY) + name;
+
+    MappedFile cached;
+    if (UMapFile(load.cachePaths[layer], cached))
+    {
+        const TextureCacheHeader* header = (const TextureCacheHeader*)cached.data;
+        const bool valid = cached.size >= sizeof(TextureCacheHeader) &&
+            memcmp(header->magic, TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC)) == 0 &&
+            header->version == TEXTURE_CACHE_VERSION && header->sourceHash == hash;
+        if (valid)
+            translucent = header->translucent != 0;
+        UUnmapFile(cached);
+        if (valid)
+            return true;
+    }
+
+    // Sources without an alpha channel are opaque without decoding them
+    int width, height, channels;
+    if (!stbi_info_from_memory(&source[0], int(source.size()), &width, &height, &channels))
+        return false;
+    translucent = false;
+    if (channels == 1 || channels == 3)
+        return true;
+    unsigned char* image = stbi_load_from_memory(&source[0], int(source.size()), &width, &height, &channels, 0);
+    if (!image)
+        return false;
+    translucent = UHasTranslucentAlpha(image, size_t(width) * height, channels);
+    stbi_image_free(image);
+    return true;
+}
+
+
+// Whether any pixel of a 2 or 4 channel image has alpha below 255
+bool UHasTranslucentAlpha(const unsigned char* pixels, size_t pixelCount, int channels)
+{
+    if (channels != 2 && channels != 4)
+        return false;
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        if (pixels[i * channels + channels - 1] != 255)
+            return true;
+    }
+    return false;
+}
+
+
+// Fills destination with the mip chain of a layer. Warm starts copy it from the memory-mapped cache
+// file UProbeTextureLayer named; cold starts decode, flip and resample the source, build the chain,
+// compress it if the array is compressed and write the cache file for the next run.
+// destination is write-only, so the chain is built in memory of its own
+bool ULoadTextureLayer(TextureArrayLoad& load, int layer, unsigned char* destination, bool& cacheHit)
+{
+    MappedFile cached;
+    if (!load.cachePaths[layer].empty() && UMapFile(load.cachePaths[layer], cached))
+    {
+        cacheHit = UValidTextureCacheFile(load, layer, cached);
+        if (cacheHit)
+            memcpy(destination, cached.data + sizeof(TextureCacheHeader), load.layerBytes);
+        UUnmapFile(cached);
+        if (cacheHit)
+            return true;
+    }
+
+    std::vector<unsigned char> source;
+    if (!UReadFile(load.filenames[layer], source) || source.empty())
+        return false;
+    const unsigned char premultiply = (load.premultipliedLayers >> layer) & 1;
+
+    // Decodes with the file's own channel count, flipping fewer bytes before the expansion
+    int width, height, channels;
+    unsigned char* image = stbi_load_from_memory(&source[0], int(source.size()), &width, &height, &channels, 0);
+    if (!image)
+        return false;
+    flipImageVertically(image, width, height, channels);
+
+    size_t chainBytes = 0;
+    for (int level = 0; level < load.levelCount; ++level)
+        chainBytes += size_t(load.size >> level) * (load.size >> level) * 4;
+    std::vector<unsigned char> chain(chainBytes);
+
+    const size_t pixelCount = size_t(width) * height;
+    const bool resample = width != load.size || height != load.size;
+    std::vector<unsigned char> expanded;
+    unsigned char* pixels = image;
+    if (channels != 4)
+    {
+        expanded.resize(pixelCount * 4);
+        pixels = resample ? &expanded[0] : &chain[0];
+        gImageKernels.expandToRGBA(image, channels, pixels, pixelCount);
+    }
+    else if (!resample)
+    {
+        memcpy(&chain[0], image, pixelCount * 4);
+        pixels = &chain[0];
+    }
+    if (premultiply)
+        gImageKernels.premultiplyAlpha(pixels, pixelCount);
+    if (resample)
+        UResampleImage(pixels, width, height, &chain[0], load.size);
+    stbi_image_free(image);
+    UBuildMipChain(&chain[0], load.size, load.levelCount);
+
+    // The layer is finished in private memory, which the quality check and the cache file read back;
+    // destination only receives a single copy of it
+    std::vector<unsigned char> blocks;
+    const unsigned char* layerData = &chain[0];
+    if (load.format != GL_RGBA8)
+    {
+        blocks.resize(load.layerBytes);
+        const unsigned char* level = &chain[0];
+        for (int i = 0; i < load.levelCount; ++i)
+        {
+            const int levelSize = load.size >> i;
+            UCompressImage(level, levelSize, load.format, &blocks[load.levelOffsets[i]]);
+            level += size_t(levelSize) * levelSize * 4;
+        }
+        layerData = &blocks[0];
+
+        // Measures the largest level against what a GPU decodes from its blocks
+        std::vector<unsigned char> decoded(size_t(load.size) * load.size * 4);
+        UDecompressImage(layerData, load.size, load.format, &decoded[0]);
+        load.layerPSNR[layer] = UMeasurePSNR(&chain[0], &decoded[0], size_t(load.size) * load.size,
+            load.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 3 : 4);
+    }
+    memcpy(destination, layerData, load.layerBytes);
+
+    // A failed write only costs the next run another decode
+    TextureCacheHeader header;
+    memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC));
+    header.version = TEXTURE_CACHE_VERSION;
+    header.format = load.format;
+    header.size = uint32_t(load.size);
+    header.levelCount = uint32_t(load.levelCount);
+    header.translucent = (load.translucentLayers >> layer) & 1;
+    header.reserved = 0;
+    header.sourceHash = load.layerHashes[layer];
+    header.dataSize = load.layerBytes;
+    if (!load.cachePaths[layer].empty())
+        UWriteCacheFile(load.cachePaths[layer], &header, sizeof(header), layerData, load.layerBytes);
+    return true;
+}
+
+
+// Whether a mapped cache file holds the whole mip chain of a layer in the array's format
+bool UValidTextureCacheFile(const TextureArrayLoad& load, int layer, const MappedFile& file)
+{
+    const TextureCacheHeader* header = (const TextureCacheHeader*)file.data;
+    return file.size >= sizeof(TextureCacheHeader) &&
+        memcmp(header->magic, TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC)) == 0 &&
+        header->version == TEXTURE_CACHE_VERSION && header->format == load.format &&
+        header->size == uint32_t(load.size) && header->levelCount == uint32_t(load.levelCount) &&
+        header->sourceHash == load.layerHashes[layer] && header->dataSize == load.layerBytes &&
+        file.size >= sizeof(TextureCacheHeader) + load.layerBytes;
+}
+
+
+// Takes in the layers decoded since the last call, then follows the residency the last frame asked
+// for: uploads the next wanted level of each layer, coarsest levels first across the layers and up to
+// TEXTURE_UPLOAD_BYTES_PER_FRAME, evicting levels no longer wanted when the budget needs the room
+void UPollTextureArrayLoad(TextureArrayLoad& load)
+{
+    glBindTexture(GL_TEXTURE_2D_ARRAY, load.texture);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, load.pixelBuffer);
+    for (int layer = 0; layer < load.layerCount && load.pendingLayers > 0; ++layer)
+    {
+        const int state = load.layerStates[layer].load(std::memory_order_acquire);
+        if (state == TEXTURE_LAYER_FAILED)
+        {
+            cout << "Failed to load texture " << load.filenames[layer] << endl;
+            load.layerStates[layer] = TEXTURE_LAYER_MISSING;
+            --load.pendingLayers;
+        }
+        if (state != TEXTURE_LAYER_DECODED && state != TEXTURE_LAYER_CACHED)
+            continue;
+
+        // The whole chain is flushed once; the levels are read from the buffer until it is released
+        if (load.pixelBuffer)
+            glFlushMappedBufferRange(GL_PIXEL_UNPACK_BUFFER, GLintptr(load.layerBytes * layer), GLsizeiptr(load.layerBytes));
+        load.layerStates[layer] = TEXTURE_LAYER_STREAMING;
+        --load.pendingLayers;
+
+        cout << "INFO: Texture " << load.filenames[layer] << " ready after "
+             << int((glfwGetTime() - load.startTime) * 1000.0) << " ms"
+             << (state == TEXTURE_LAYER_CACHED ? " (cached)" : " (decoded)");
+        if (load.layerPSNR[layer] > 0.0f)
+            cout << ", PSNR " << load.layerPSNR[layer] << " dB";
+        cout << endl;
+    }
+
+    // Makes room for levels already resident beyond the budget, such as after the budget shrinks
+    UEvictUnwantedTextureLevels(load, 0);
+
+    size_t uploadedBytes = 0;
+    bool uploadBudgetSpent = false;
+    for (int level = load.levelCount - 1; level >= 0 && !uploadBudgetSpent; --level)
+    {
+        const size_t levelBytes = UTextureLevelBytes(load.format, load.size >> level);
+        for (int layer = 0; layer < load.layerCount; ++layer)
+        {
+            if (load.layerStates[layer].load(std::memory_order_relaxed) != TEXTURE_LAYER_STREAMING ||
+                load.residentLevels[layer] != level + 1 || level < load.wantedLevels[layer])
+                continue;
+            if (uploadedBytes > 0 && uploadedBytes + levelBytes > TEXTURE_UPLOAD_BYTES_PER_FRAME)
+            {
+                uploadBudgetSpent = true;
+                break;
+            }
+            if (!UEvictUnwantedTextureLevels(load, levelBytes))
+                continue;
+
+            UUploadTextureLevel(load, layer, level);
+            uploadedBytes += levelBytes;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    if (load.residentBytes != load.loggedResidentBytes && uploadedBytes == 0)
+    {
+        cout << "INFO: Texture residency: " << load.residentBytes / 1024 << " KB of "
+             << gTextureBudgetBytes / 1024 << " KB budget" << endl;
+        load.loggedResidentBytes = load.residentBytes;
+    }
+
+    // Once every layer is in and a frame had nothing to upload, evicted levels can come back from the
+    // mapped cache files, which the OS pages in and out, so the chains no longer need the upload buffer
+    if (load.pixels && !load.keepUploadBuffer && load.pendingLayers == 0 && uploadedBytes == 0)
+    {
+        if (UMapTextureCacheFiles(load))
+        {
+            cout << "INFO: Texture upload buffer of " << (load.layerBytes * load.layerCount) / 1024
+                 << " KB released, evicted levels reload from the cache files" << endl;
+            UReleaseTextureUploadBuffer(load);
+        }
+        else
+        {
+            cout << "INFO: Keeping the texture upload buffer, a layer has no cache file" << endl;
+            load.keepUploadBuffer = true;
+        }
+    }
+}
+
+
+// Picks the finest level each layer needs: about one texel per pixel across the largest visible object
+// that uses it, or the smallest level when none is on screen. Then coarsens the finest wanted levels,
+// smallest objects first, until the wanted chains fit the budget
+void UUpdateTextureResidency(TextureArrayLoad& load, const GLMesh& mesh, const glm::mat4& view, const glm::mat4& projection)
+{
+    const GLCullSpheres& spheres = mesh.cullSpheres;
+    const bool perspectiveProjection = projection[2][3] != 0.0f;
+    const float pixelsPerUnit = projection[1][1] * 0.5f * WINDOW_HEIGHT;
+
+    std::vector<float>& diameters = load.diameters;
+    diameters.assign(load.layerCount, 0.0f);
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        const GLInstance& instance = mesh.instances[i];
+        if (!instance.visible || int(instance.material) >= load.layerCount)
+            continue;
+
+        float diameter = 2.0f * spheres.radius[i] * pixelsPerUnit;
+        if (perspectiveProjection)
+            diameter /= std::max(glm::length(glm::vec3(view * glm::vec4(spheres.x[i], spheres.y[i], spheres.z[i], 1.0f))), 0.1f);
+        diameters[instance.material] = std::max(diameters[instance.material], diameter);
+    }
+
+    size_t wantedBytes = 0;
+    for (int layer = 0; layer < load.layerCount; ++layer)
+    {
+        int level = load.levelCount - 1;
+        if (diameters[layer] >= 1.0f)
+            level = std::min(std::max(int(floorf(log2f(load.size / diameters[layer]))), 0), load.levelCount - 1);
+        load.wantedLevels[layer] = level;
+        wantedBytes += load.layerBytes - load.levelOffsets[level];
+    }
+
+    while (wantedBytes > gTextureBudgetBytes)
+    {
+        int layer = -1;
+        for (int candidate = 0; candidate < load.layerCount; ++candidate)
+        {
+            const int level = load.wantedLevels[candidate];
+            if (level + 1 >= load.levelCount)
+                continue;
+            if (layer < 0 || level < load.wantedLevels[layer] ||
+                (level == load.wantedLevels[layer] && diameters[candidate] < diameters[layer]))
+                layer = candidate;
+        }
+        if (layer < 0)
+            break;
+
+        const int level = load.wantedLevels[layer]++;
+        wantedBytes -= load.levelOffsets[level + 1] - load.levelOffsets[level];
+    }
+}
+
+
+// Uploads a level from the layer's chain in the upload buffer, or from its mapped cache file once the
+// buffer is released, committing its pages first when sparse. Expects the texture and the unpack
+// buffer to be bound
+void UUploadTextureLevel(TextureArrayLoad& load, int layer, int level)
+{
+    const GLsizei levelSize = load.size >> level;
+    const size_t levelBytes = UTextureLevelBytes(load.format, levelSize);
+    if (load.sparse && level < load.sparseLevels)
+        glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, GL_TRUE);
+
+    // Reads from the unpack buffer when there is one, from client memory otherwise
+    const size_t offset = load.layerBytes * layer + load.levelOffsets[level];
+    const void* pixels = load.pixelBuffer ? (const void*)offset : (const void*)(load.pixels + offset);
+    if (!load.pixels)
+        pixels = load.cacheFiles[layer].data + sizeof(TextureCacheHeader) + load.levelOffsets[level];
+    if (load.format == GL_RGBA8)
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    else
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, load.format, GLsizei(levelBytes), pixels);
+
+    load.residentLevels[layer] = level;
+    load.residentBytes += levelBytes;
+    load.minLods[layer] = float(level);
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Stops sampling the finest resident level of a layer and releases its pages when sparse
+void UEvictTextureLevel(TextureArrayLoad& load, int layer)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    const int level = load.residentLevels[layer];
+    const GLsizei levelSize = load.size >> level;
+    if (load.sparse && level < load.sparseLevels)
+        glTexPageCommitmentARB(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, GL_FALSE);
+
+    load.residentLevels[layer] = level + 1;
+    load.residentBytes -= UTextureLevelBytes(load.format, levelSize);
+    load.minLods[layer] = float(std::min(level + 1, load.levelCount - 1));
+}
+
+
+// Evicts levels finer than their layer wants, largest first, until bytesNeeded more fit the budget.
+// Levels stay resident while there is room, so a camera moving back and forth does not reload them
+bool UEvictUnwantedTextureLevels(TextureArrayLoad& load, size_t bytesNeeded)
+{
+    while (load.residentBytes + bytesNeeded > gTextureBudgetBytes)
+    {
+        int layer = -1;
+        for (int candidate = 0; candidate < load.layerCount; ++candidate)
+        {
+            if (load.residentLevels[candidate] < load.wantedLevels[candidate] &&
+                (layer < 0 || load.residentLevels[candidate] < load.residentLevels[layer]))
+                layer = candidate;
+        }
+        if (layer < 0)
+            return false;
+        UEvictTextureLevel(load, layer);
+    }
+    return true;
+}
+
+
+// Maps the cache file of every streaming layer that is not mapped yet; false when one is missing or stale
+bool UMapTextureCacheFiles(TextureArrayLoad& load)
+{
+    for (int layer = 0; layer < load.layerCount; ++layer)
+    {
+        MappedFile& file = load.cacheFiles[layer];
+        if (file.data || load.layerStates[layer].load(std::memory_order_relaxed) != TEXTURE_LAYER_STREAMING)
+            continue;
+        if (load.cachePaths[layer].empty() || !UMapFile(load.cachePaths[layer], file))
+            return false;
+        if (!UValidTextureCacheFile(load, layer, file))
+        {
+            UUnmapFile(file);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Waits for the decoding jobs still running, releases the upload buffer and unmaps the cache files
+void UEndTextureArrayLoad(TextureArrayLoad& load)
+{
+    gThreadPool.Wait(JOB_GROUP_TEXTURES);
+    UReleaseTextureUploadBuffer(load);
+    for (size_t layer = 0; layer < load.cacheFiles.size(); ++layer)
+        UUnmapFile(load.cacheFiles[layer]);
+}
+
+
+// Frees the upload buffer or the staging memory holding the layers' mip chains
+void UReleaseTextureUploadBuffer(TextureArrayLoad& load)
+{
+    if (load.pixelBuffer)
+    {
+        // The uploads already issued keep the buffer alive until they complete
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, load.pixelBuffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &load.pixelBuffer);
+        load.pixelBuffer = 0;
+    }
+    load.pixels = NULL;
+    std::vector<unsigned char>().swap(load.staging);
+}
+
+
+void UDestroyTexture(GLuint textureId)
+{
+    glDeleteTextures(1, &textureId);
+}
+
+
+// Inserts #define lines right after the #version line of a GLSL source
+std::string UInjectDefines(const char* source, const std::string& defines)
+{
+    std::string result(source);
+    size_t lineEnd = result.find('\n');
+    result.insert(lineEnd == std::string::npos ? result.size() : lineEnd + 1, defines);
+    return result;
+}
+
+
+// Builds the shader program variant for a ShaderFeature mask, defining every feature as 0 or 1.
+// Linked programs are kept in the program binary cache, so later runs skip compiling and linking
+bool UCreateShaderProgram(unsigned int features, GLuint& programId, GLUniforms& uniforms)
+{
+    std::string defines;
+    for (int feature = 0; feature < SHADER_FEATURE_COUNT; ++feature)
+        defines += std::string("#define ") + SHADER_FEATURE_DEFINES[feature] + ((features >> feature) & 1 ? " 1\n" : " 0\n");
+    defines += "#define CLUSTER_GRID_X " + std::to_string(CLUSTER_GRID_X) + "u\n";
+    defines += "#define CLUSTER_GRID_Y " + std::to_string(CLUSTER_GRID_Y) + "u\n";
+    defines += "#define CLUSTER_GRID_Z " + std::to_string(CLUSTER_GRID_Z) + "u\n";
+    defines += "#define TEXTURE_ARRAY_MAX_LAYERS " + std::to_string(TEXTURE_ARRAY_MAX_LAYERS) + "\n";
+    defines += "#define SHADOW_LAYER_SPOTLIGHT " + std::to_string(int(SHADOW_LAYER_SPOTLIGHT)) + ".0\n";
+    defines += "#define SHADOW_LAYER_KEY_LIGHT " + std::to_string(int(SHADOW_LAYER_KEY_LIGHT)) + ".0\n";
+    const std::string vertexSource = UInjectDefines(vertexShaderSource, defines);
+    const std::string fragmentSource = UInjectDefines(fragmentShaderSource, defines);
+
+    // Entries are named after the sources. An entry another driver wrote is rejected by the driver hash
+    // inside and overwritten once the program is linked, so a driver update costs a single relink
+    const double startTime = glfwGetTime();
+    const bool cacheBinaries = gCacheShaderPrograms && UProgramBinariesSupported();
+    const uint64_t sourceHash = UHashBytes(fragmentSource.data(), fragmentSource.size(),
+        UHashBytes(vertexSource.data(), vertexSource.size(), FNV64_OFFSET_BASIS));
+    const uint64_t driverHash = cacheBinaries ? UHashDriver() : 0;
+    char cacheName[32];
+    snprintf(cacheName, sizeof(cacheName), "%016llx.uprog", (unsigned long long)sourceHash);
+    const std::string cachePath = std::string(CACHE_DIRECTORY) + cacheName;
 
     // Create a Shader program object.
     programId = glCreateProgram();
 
+    const bool cacheHit = cacheBinaries && ULoadProgramBinary(cachePath, sourceHash, driverHash, programId);
+    if (!cacheHit)
+    {
+        // A program whose binary was rejected is left unlinked, so it is linked from source instead
+        if (cacheBinaries)
+            glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        if (!UCompileShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), programId))
+            return false;
+        if (cacheBinaries)
+            USaveProgramBinary(cachePath, sourceHash, driverHash, programId);
+    }
+    cout << "INFO: Shader variant " << features << (cacheHit ? ": program binary cache hit, loaded in " :
+        cacheBinaries ? ": program binary cache miss, compiled and linked in " : ": compiled and linked in ")
+         << (glfwGetTime() - startTime) * 1000.0 << " ms" << endl;
+
+    glUseProgram(programId);    // Uses the shader program
+
+    // Resolves the uniform locations once so the render loop never queries them
+    uniforms.uTexture = glGetUniformLocation(programId, "uTexture");
+    uniforms.uLayerMinLod = glGetUniformLocation(programId, "uLayerMinLod");
+    uniforms.uClusterParams = glGetUniformLocation(programId, "uClusterParams");
+    uniforms.uShadowMap = glGetUniformLocation(programId, "uShadowMap");
+    uniforms.uShadowViewProjection = glGetUniformLocation(programId, "uShadowViewProjection");
+
+    // Tells opengl for each sampler to which texture unit it belongs to
+    glUniform1i(uniforms.uTexture, 0);
+    glUniform1i(uniforms.uShadowMap, SHADOW_TEXTURE_UNIT);
+
+    return true;
+}
+
+
+// Compiles the vertex and fragment shaders and links them into the program
+bool UCompileShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint programId)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
     // Create the vertex and fragment shader objects
     GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
     GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
@@ -1120,8 +4911,6 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
         return false;
     }
 
-    glUseProgram(programId);    // Uses the shader program
-
     return true;
 }
 
@@ -1130,3 +4919,704 @@ void UDestroyShaderProgram(GLuint programId)
 {
     glDeleteProgram(programId);
 }
+
+
+// Program binaries need GL 4.1 or ARB_get_program_binary, and a driver that offers at least one format
+bool UProgramBinariesSupported()
+{
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+        return false;
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    return formatCount > 0;
+}
+
+
+// Hashes the strings identifying the driver; binaries are only valid for the driver that linked them
+uint64_t UHashDriver()
+{
+    const GLenum names[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    uint64_t hash = FNV64_OFFSET_BASIS;
+    for (int i = 0; i < 3; ++i)
+    {
+        const char* value = (const char*)glGetString(names[i]);
+        if (value)
+            hash = UHashBytes(value, strlen(value) + 1, hash);
+    }
+    return hash;
+}
+
+
+// Links the program from a cached binary; false when there is no entry, it belongs to other sources or
+// another driver, or the driver rejects it
+bool ULoadProgramBinary(const std::string& path, uint64_t sourceHash, uint64_t driverHash, GLuint programId)
+{
+    std::vector<unsigned char> contents;
+    if (!UReadFile(path, contents) || contents.size() < sizeof(ProgramCacheHeader))
+        return false;
+
+    // The size is checked against what is left after the header, so a corrupt size cannot wrap around
+    const ProgramCacheHeader* header = (const ProgramCacheHeader*)contents.data();
+    const bool valid = memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC)) == 0 &&
+        header->version == PROGRAM_CACHE_VERSION && header->sourceHash == sourceHash &&
+        header->binarySize <= contents.size() - sizeof(ProgramCacheHeader);
+    if (!valid)
+        return false;
+    if (header->driverHash != driverHash)
+    {
+        cout << "INFO: Program binary cache entry " << path << " was linked by another driver" << endl;
+        return false;
+    }
+
+    glProgramBinary(programId, header->binaryFormat, contents.data() + sizeof(ProgramCacheHeader), GLsizei(header->binarySize));
+    GLint success = 0;
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+        cout << "INFO: Program binary cache entry " << path << " was rejected by the driver" << endl;
+    return success != 0;
+}
+
+
+// Stores the binary of a linked program in the cache, replacing an entry another driver wrote
+void USaveProgramBinary(const std::string& path, uint64_t sourceHash, uint64_t driverHash, GLuint programId)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<unsigned char> binary(length);
+    GLsizei written = 0;
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(programId, length, &written, &binaryFormat, &binary[0]);
+    if (written <= 0)
+        return;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+    header.version = PROGRAM_CACHE_VERSION;
+    header.binaryFormat = binaryFormat;
+    header.sourceHash = sourceHash;
+    header.driverHash = driverHash;
+    header.binarySize = uint64_t(written);
+    UCreateCacheDirectory();
+    if (!UWriteCacheFile(path, &header, sizeof(header), &binary[0], size_t(written)))
+        cout << "INFO: Program binary cache entry " << path << " could not be written" << endl;
+}
+
+
+// Feature mask matching the mesh's vertex format and the current lights; a light without intensity
+// adds nothing, and a spotlight without linear and quadratic terms keeps a constant attenuation
+unsigned int USelectShaderFeatures(const GLMesh& mesh, const LightBlock& lights, const ClusteredLights& clustered, const ShadowMaps& shadows)
+{
+    unsigned int features = 0;
+    if (mesh.compactVertices)
+        features |= SHADER_COMPACT_VERTICES;
+    if (lights.keyLight.intensity != 0.0f)
+        features |= SHADER_KEY_LIGHT;
+    if (lights.fillLight.intensity != 0.0f)
+        features |= SHADER_FILL_LIGHT;
+    if (lights.spotlight.intensity != 0.0f)
+    {
+        features |= SHADER_SPOTLIGHT;
+        if (lights.spotlight.linear != 0.0f || lights.spotlight.quadratic != 0.0f)
+            features |= SHADER_SPOT_ATTENUATION;
+    }
+    if (!clustered.lights.empty())
+        features |= SHADER_CLUSTERED_LIGHTS;
+    if (shadows.texture != 0 && (features & (SHADER_KEY_LIGHT | SHADER_SPOTLIGHT)) != 0)
+        features |= SHADER_SHADOWS;
+    return features;
+}
+
+
+// Makes the variant for a feature mask current, building it on first use; returns false, keeping the
+// previous program, if it does not build
+bool UUseShaderVariant(unsigned int features)
+{
+    std::map<unsigned int, ShaderVariant>::iterator found = gShaderVariants.find(features);
+    if (found == gShaderVariants.end())
+    {
+        ShaderVariant variant = ShaderVariant();
+        if (!UCreateShaderProgram(features, variant.programId, variant.uniforms))
+        {
+            // Failed variants are remembered, so a broken one is not rebuilt every frame
+            glDeleteProgram(variant.programId);
+            variant.programId = 0;
+        }
+        else
+        {
+            cout << "INFO: Built shader variant " << features << ":";
+            for (int feature = 0; feature < SHADER_FEATURE_COUNT; ++feature)
+            {
+                if ((features >> feature) & 1)
+                    cout << " " << SHADER_FEATURE_DEFINES[feature];
+            }
+            cout << endl;
+        }
+        found = gShaderVariants.insert(std::make_pair(features, variant)).first;
+    }
+
+    if (found->second.programId == 0)
+    {
+        if (gProgramId != 0)
+            glUseProgram(gProgramId);
+        return false;
+    }
+
+    gProgramId = found->second.programId;
+    gUniforms = found->second.uniforms;
+    glUseProgram(gProgramId);
+    return true;
+}
+
+
+void UDestroyShaderVariants()
+{
+    for (std::map<unsigned int, ShaderVariant>::iterator it = gShaderVariants.begin(); it != gShaderVariants.end(); ++it)
+        UDestroyShaderProgram(it->second.programId);
+    gShaderVariants.clear();
+    gProgramId = 0;
+}
+
+
+// Creates the light and camera uniform buffers and uploads the scene lights
+void UCreateUniformBuffers()
+{
+    // Key light
+    gLightBlock.keyLight.position = glm::vec3(10.0f, 0.0f, 0.0f); // Adjusted position
+    gLightBlock.keyLight.color = glm::vec3(1.0f, 1.0f, 1.0f); // Bright white
+    gLightBlock.keyLight.intensity = 1.0f; // 100% intensity
+
+    // Fill light
+    gLightBlock.fillLight.position = glm::vec3(-5.0f, 10.0f, 10.0f); // Adjusted position
+    gLightBlock.fillLight.color = glm::vec3(1.0f, 1.0f, 1.0f); // white
+    gLightBlock.fillLight.intensity = 0.0f; // Disabled; the shader variant leaves it out
+
+    // Spotlight properties
+    gLightBlock.spotlight.position = glm::vec3(1.0f, 5.0f, 6.0f);
+    gLightBlock.spotlight.direction = glm::vec3(0.0f, -1.0f, -1.0f);
+    gLightBlock.spotlight.color = glm::vec3(0.5f, 0.7f, 1.0f); // Light blue
+    gLightBlock.spotlight.intensity = 1.0f;
+    gLightBlock.spotlight.cutOff = glm::cos(glm::radians(12.5f));
+    gLightBlock.spotlight.outerCutOff = glm::cos(glm::radians(15.0f));
+    gLightBlock.spotlight.constant = 1.0f;
+    gLightBlock.spotlight.linear = 0.09f;
+    gLightBlock.spotlight.quadratic = 0.032f;
+    gLightsDirty = true;
+
+    glGenBuffers(1, &gLightUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gLightUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, gLightUbo);
+
+    glGenBuffers(1, &gCameraUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gCameraUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, gCameraUbo);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+void UDestroyUniformBuffers()
+{
+    glDeleteBuffers(1, &gLightUbo);
+    glDeleteBuffers(1, &gCameraUbo);
+}
+
+
+// Uploads the lights and camera, skipping anything that has not changed
+void UUpdateUniformBuffers(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos)
+{
+    if (gLightsDirty)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, gLightUbo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightBlock), &gLightBlock);
+        gLightsDirty = false;
+    }
+
+    CameraBlock camera;
+    camera.view = view;
+    camera.projection = projection;
+    camera.viewProjection = projection * view;
+    camera.viewPos = viewPos;
+    camera.padding = 0.0f;
+    bool cameraChanged = !gCameraValid || memcmp(&camera, &gCameraBlock, sizeof(CameraBlock)) != 0;
+    if (cameraChanged)
+    {
+        gCameraBlock = camera;
+        glBindBuffer(GL_UNIFORM_BUFFER, gCameraUbo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraBlock), &gCameraBlock);
+        gCameraValid = true;
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+// Creates the shader storage buffers of the clustered lighting and binds them to their binding points
+void UCreateClusteredLights(ClusteredLights& clustered)
+{
+    clustered.lights.clear();
+    clustered.lightsDirty = true;
+    clustered.boundsValid = false;
+    clustered.clusterRanges.assign(CLUSTER_COUNT * 2, 0);
+    clustered.lightIndices.clear();
+    clustered.loggedLightCount = 0;
+
+    // Every buffer starts with storage, so the bindings are valid before the first light is added
+    clustered.lightCapacity = 1;
+    clustered.indexCapacity = 1;
+    glGenBuffers(1, &clustered.lightBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.lightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.lightCapacity * sizeof(LocalLight), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LOCAL_LIGHT_BINDING, clustered.lightBuffer);
+
+    glGenBuffers(1, &clustered.clusterBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.clusterRanges.size() * sizeof(GLuint), &clustered.clusterRanges[0], GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BINDING, clustered.clusterBuffer);
+
+    glGenBuffers(1, &clustered.indexBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.indexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.indexCapacity * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BINDING, clustered.indexBuffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyClusteredLights(ClusteredLights& clustered)
+{
+    glDeleteBuffers(1, &clustered.lightBuffer);
+    glDeleteBuffers(1, &clustered.clusterBuffer);
+    glDeleteBuffers(1, &clustered.indexBuffer);
+    clustered.lights.clear();
+}
+
+
+// Scatters point lights and downward spotlights of assorted colors just above the counter
+void UCreateLocalLights(ClusteredLights& clustered, unsigned int count)
+{
+    clustered.lights.clear();
+    uint32_t seed = 12345u;
+    auto random = [&seed]()
+    {
+        // Park-Miller generator, so every run places the lights the same way
+        seed = uint32_t((uint64_t(seed) * 48271u) % 2147483647u);
+        return float(seed) / 2147483647.0f;
+    };
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        LocalLight light;
+        light.position = glm::vec3(-4.0f + 8.0f * random(), -0.7f + 0.6f * random(), -4.0f + 8.0f * random());
+        light.range = 0.75f + 1.25f * random();
+        // Hues around the color wheel, dimmed as the light count grows so the scene keeps its exposure
+        const float hue = 6.0f * random();
+        const glm::vec3 color = glm::clamp(glm::vec3(fabsf(hue - 3.0f) - 1.0f, 2.0f - fabsf(hue - 2.0f), 2.0f - fabsf(hue - 4.0f)), 0.0f, 1.0f);
+        light.color = color * (16.0f / sqrtf(float(count)));
+        if (i % 4 == 3)
+        {
+            light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+            light.cutOff = cosf(glm::radians(20.0f));
+            light.outerCutOff = cosf(glm::radians(30.0f));
+        }
+        else
+        {
+            light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+            light.cutOff = -2.0f;
+            light.outerCutOff = -3.0f;
+        }
+        clustered.lights.push_back(light);
+    }
+    clustered.lightsDirty = true;
+}
+
+
+// View-space bounding boxes of the froxels, found by unprojecting the corners of each screen tile
+// onto the depths of its slice; works for perspective and orthographic projections alike
+void UComputeClusterBounds(ClusteredLights& clustered, const glm::mat4& projection)
+{
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    auto unproject = [&inverseProjection](float x, float y, float z)
+    {
+        glm::vec4 point = inverseProjection * glm::vec4(x, y, z, 1.0f);
+        return glm::vec3(point) / point.w;
+    };
+
+    // Each corner ray, from the near to the far plane, for every tile corner
+    const GLuint cornersX = CLUSTER_GRID_X + 1, cornersY = CLUSTER_GRID_Y + 1;
+    std::vector<glm::vec3> rayNear(cornersX * cornersY), rayFar(cornersX * cornersY);
+    for (GLuint y = 0; y < cornersY; ++y)
+    {
+        for (GLuint x = 0; x < cornersX; ++x)
+        {
+            const float ndcX = -1.0f + 2.0f * x / CLUSTER_GRID_X;
+            const float ndcY = -1.0f + 2.0f * y / CLUSTER_GRID_Y;
+            rayNear[y * cornersX + x] = unproject(ndcX, ndcY, -1.0f);
+            rayFar[y * cornersX + x] = unproject(ndcX, ndcY, 1.0f);
+        }
+    }
+
+    // Padded so the last group of four can always be loaded whole
+    const size_t paddedCount = CLUSTER_COUNT + 3;
+    clustered.minX.assign(paddedCount, 0.0f);
+    clustered.minY.assign(paddedCount, 0.0f);
+    clustered.minZ.assign(paddedCount, 0.0f);
+    clustered.maxX.assign(paddedCount, 0.0f);
+    clustered.maxY.assign(paddedCount, 0.0f);
+    clustered.maxZ.assign(paddedCount, 0.0f);
+    for (GLuint z = 0; z < CLUSTER_GRID_Z; ++z)
+    {
+        const float sliceDepths[2] = {
+            CLIP_NEAR * powf(CLIP_FAR / CLIP_NEAR, float(z) / CLUSTER_GRID_Z),
+            CLIP_NEAR * powf(CLIP_FAR / CLIP_NEAR, float(z + 1) / CLUSTER_GRID_Z)
+        };
+        for (GLuint y = 0; y < CLUSTER_GRID_Y; ++y)
+        {
+            for (GLuint x = 0; x < CLUSTER_GRID_X; ++x)
+            {
+                glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+                for (int corner = 0; corner < 4; ++corner)
+                {
+                    const GLuint ray = (y + corner / 2) * cornersX + x + corner % 2;
+                    for (int d = 0; d < 2; ++d)
+                    {
+                        // View space looks down -z
+                        float t = (sliceDepths[d] + rayNear[ray].z) / (rayNear[ray].z - rayFar[ray].z);
+                        glm::vec3 point = rayNear[ray] + (rayFar[ray] - rayNear[ray]) * t;
+                        boundsMin = glm::min(boundsMin, point);
+                        boundsMax = glm::max(boundsMax, point);
+                    }
+                }
+                const size_t cluster = x + CLUSTER_GRID_X * (y + CLUSTER_GRID_Y * z);
+                clustered.minX[cluster] = boundsMin.x;
+                clustered.minY[cluster] = boundsMin.y;
+                clustered.minZ[cluster] = boundsMin.z;
+                clustered.maxX[cluster] = boundsMax.x;
+                clustered.maxY[cluster] = boundsMax.y;
+                clustered.maxZ[cluster] = boundsMax.z;
+            }
+        }
+    }
+
+    clustered.boundsProjection = projection;
+    clustered.boundsValid = true;
+}
+
+
+// Finds the clusters each light's bounding sphere touches, four clusters of a row per test, and
+// uploads the lights grouped by cluster
+void UAssignLightsToClusters(ClusteredLights& clustered, const glm::mat4& view, const glm::mat4& projection)
+{
+    if (!clustered.boundsValid || memcmp(&clustered.boundsProjection, &projection, sizeof(glm::mat4)) != 0)
+        UComputeClusterBounds(clustered, projection);
+
+    const float logDepthScale = CLUSTER_GRID_Z / logf(CLIP_FAR / CLIP_NEAR);
+    auto sliceOf = [logDepthScale](float depth)
+    {
+        return int(logf(std::max(depth, CLIP_NEAR) / CLIP_NEAR) * logDepthScale);
+    };
+
+    // (cluster, light) pairs, counting sorted by cluster afterwards
+    std::vector<GLuint>& pairClusters = clustered.pairClusters;
+    std::vector<GLuint>& pairLights = clustered.pairLights;
+    pairClusters.clear();
+    pairLights.clear();
+    for (size_t i = 0; i < clustered.lights.size(); ++i)
+    {
+        // A spotlight's sphere encloses its cone rather than its whole range
+        const LocalLight& light = clustered.lights[i];
+        glm::vec3 center = light.position;
+        float radius = light.range;
+        if (light.outerCutOff > -1.0f)
+        {
+            const float cosine = std::max(light.outerCutOff, 0.0f);
+            if (cosine > 0.70710678f)
+            {
+                radius = light.range / (2.0f * cosine);
+                center = light.position + light.direction * radius;
+            }
+            else
+            {
+                center = light.position + light.direction * (light.range * cosine);
+                radius = light.range * sqrtf(1.0f - cosine * cosine);
+            }
+        }
+
+        const glm::vec3 viewCenter = glm::vec3(view * glm::vec4(center, 1.0f));
+        const float depth = -viewCenter.z;
+        if (depth + radius < CLIP_NEAR || depth - radius > CLIP_FAR)
+            continue;
+        const int firstSlice = std::max(sliceOf(depth - radius), 0);
+        const int lastSlice = std::min(sliceOf(depth + radius), int(CLUSTER_GRID_Z) - 1);
+
+        for (int z = firstSlice; z <= lastSlice; ++z)
+        {
+            for (GLuint y = 0; y < CLUSTER_GRID_Y; ++y)
+            {
+                const size_t row = CLUSTER_GRID_X * (y + CLUSTER_GRID_Y * z);
+                for (GLuint x = 0; x < CLUSTER_GRID_X; x += 4)
+                {
+                    // Squared distance from the center to the nearest point of each box
+                    const size_t cluster = row + x;
+                    int mask;
+#ifdef U_USE_SSE2
+                    const __m128 zero = _mm_setzero_ps();
+                    const __m128 centerX = _mm_set1_ps(viewCenter.x);
+                    const __m128 centerY = _mm_set1_ps(viewCenter.y);
+                    const __m128 centerZ = _mm_set1_ps(viewCenter.z);
+                    __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clustered.minX[cluster]), centerX),
+                        _mm_sub_ps(centerX, _mm_loadu_ps(&clustered.maxX[cluster]))), zero);
+                    __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clustered.minY[cluster]), centerY),
+                        _mm_sub_ps(centerY, _mm_loadu_ps(&clustered.maxY[cluster]))), zero);
+                    __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&clustered.minZ[cluster]), centerZ),
+                        _mm_sub_ps(centerZ, _mm_loadu_ps(&clustered.maxZ[cluster]))), zero);
+                    __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                    mask = _mm_movemask_ps(_mm_cmple_ps(distance, _mm_set1_ps(radius * radius)));
+#else
+                    mask = 0;
+                    for (int lane = 0; lane < 4; ++lane)
+                    {
+                        const size_t c = cluster + lane;
+                        float dx = std::max(std::max(clustered.minX[c] - viewCenter.x, viewCenter.x - clustered.maxX[c]), 0.0f);
+                        float dy = std::max(std::max(clustered.minY[c] - viewCenter.y, viewCenter.y - clustered.maxY[c]), 0.0f);
+                        float dz = std::max(std::max(clustered.minZ[c] - viewCenter.z, viewCenter.z - clustered.maxZ[c]), 0.0f);
+                        if (dx * dx + dy * dy + dz * dz <= radius * radius)
+                            mask |= 1 << lane;
+                    }
+#endif
+                    for (int lane = 0; lane < 4; ++lane)
+                    {
+                        if ((mask >> lane) & 1)
+                        {
+                            pairClusters.push_back(GLuint(cluster + lane));
+                            pairLights.push_back(GLuint(i));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Counting sort into one contiguous index range per cluster
+    std::vector<GLuint>& ranges = clustered.clusterRanges;
+    std::fill(ranges.begin(), ranges.end(), 0);
+    for (size_t i = 0; i < pairClusters.size(); ++i)
+        ++ranges[pairClusters[i] * 2 + 1];
+    GLuint offset = 0, maxCount = 0;
+    for (GLuint c = 0; c < CLUSTER_COUNT; ++c)
+    {
+        ranges[c * 2] = offset;
+        offset += ranges[c * 2 + 1];
+        maxCount = std::max(maxCount, ranges[c * 2 + 1]);
+        ranges[c * 2 + 1] = 0;
+    }
+    clustered.lightIndices.resize(pairLights.size());
+    for (size_t i = 0; i < pairClusters.size(); ++i)
+    {
+        GLuint* range = &ranges[pairClusters[i] * 2];
+        clustered.lightIndices[range[0] + range[1]++] = pairLights[i];
+    }
+
+    if (clustered.lightsDirty)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.lightBuffer);
+        if (clustered.lights.size() > clustered.lightCapacity)
+        {
+            clustered.lightCapacity = clustered.lights.size();
+            glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.lightCapacity * sizeof(LocalLight), NULL, GL_DYNAMIC_DRAW);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LOCAL_LIGHT_BINDING, clustered.lightBuffer);
+        }
+        if (!clustered.lights.empty())
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, clustered.lights.size() * sizeof(LocalLight), &clustered.lights[0]);
+        clustered.lightsDirty = false;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.clusterBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, ranges.size() * sizeof(GLuint), &ranges[0]);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.indexBuffer);
+    if (clustered.lightIndices.size() > clustered.indexCapacity)
+    {
+        // Doubles, so the buffer settles after a few frames of camera movement
+        clustered.indexCapacity = std::max(clustered.lightIndices.size(), clustered.indexCapacity * 2);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.indexCapacity * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BINDING, clustered.indexBuffer);
+    }
+    if (!clustered.lightIndices.empty())
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, clustered.lightIndices.size() * sizeof(GLuint), &clustered.lightIndices[0]);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    if (clustered.lights.size() != clustered.loggedLightCount)
+    {
+        cout << "INFO: Clustered lighting: " << clustered.lights.size() << " local lights, " << clustered.lightIndices.size()
+             << " light-cluster pairs, at most " << maxCount << " lights per cluster" << endl;
+        clustered.loggedLightCount = clustered.lights.size();
+    }
+}
+
+
+// Creates the shadow map array and the framebuffer it is rendered through; leaves shadows off if
+// gShadows is cleared or the depth-only framebuffer is not supported
+void UCreateShadowMaps(ShadowMaps& shadows)
+{
+    shadows.texture = 0;
+    shadows.framebuffer = 0;
+    shadows.valid = false;
+    shadows.renderCount = 0;
+    if (!gShadows)
+        return;
+
+    // Hardware depth comparison, so each filtered lookup returns the lit fraction of four texels
+    glGenTextures(1, &shadows.texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadows.texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_LAYER_COUNT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &shadows.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadows.framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadows.texture, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cerr << "ERROR: Shadow map framebuffer incomplete (" << status << "), shadows are off" << endl;
+        UDestroyShadowMaps(shadows);
+        return;
+    }
+
+    cout << "INFO: Shadow maps: " << SHADOW_LAYER_COUNT << " layers of " << SHADOW_MAP_SIZE << "x" << SHADOW_MAP_SIZE << endl;
+}
+
+
+void UDestroyShadowMaps(ShadowMaps& shadows)
+{
+    glDeleteFramebuffers(1, &shadows.framebuffer);
+    glDeleteTextures(1, &shadows.texture);
+    shadows.framebuffer = 0;
+    shadows.texture = 0;
+    shadows.valid = false;
+}
+
+
+// Perspective view-projection of a light looking along a unit direction, covering halfAngle around it;
+// the depth range is fitted to the scene's bounding sphere
+glm::mat4 ULightViewProjection(const glm::vec3& position, const glm::vec3& direction, float halfAngle,
+    const glm::vec3& sceneCenter, float sceneRadius)
+{
+    const float distance = glm::dot(sceneCenter - position, direction);
+    const float farPlane = std::max(distance + sceneRadius, CLIP_NEAR);
+    const float nearPlane = std::max(distance - sceneRadius, farPlane * SHADOW_MIN_NEAR_RATIO);
+    const glm::vec3 up = fabsf(direction.y) > 0.99f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    return glm::perspective(2.0f * halfAngle, 1.0f, nearPlane, farPlane) * glm::lookAt(position, position + direction, up);
+}
+
+
+// Re-renders both shadow maps when a light they were rendered for was edited or a shadow caster moved.
+// Otherwise the maps of an earlier frame are reused, and the frame has no depth pass at all
+void UUpdateShadowMaps(ShadowMaps& shadows, const GLMesh& mesh, const SceneGraph& scene)
+{
+    if (shadows.texture == 0 || mesh.shadowCommands.empty())
+        return;
+
+    const bool lightsChanged = memcmp(&shadows.keyLight, &gLightBlock.keyLight, sizeof(PointLight)) != 0 ||
+        memcmp(&shadows.spotlight, &gLightBlock.spotlight, sizeof(Spotlight)) != 0;
+    // Receivers moving do not change what the lights see, only the casters do
+    bool castersChanged = false;
+    if (scene.hasChangedNodes)
+    {
+        for (size_t i = 0; i < mesh.instances.size() && !castersChanged; ++i)
+        {
+            const GLInstance& instance = mesh.instances[i];
+            castersChanged = ((SHADOW_CASTER_MATERIALS >> instance.material) & 1) != 0 && scene.changed[instance.node];
+        }
+    }
+    if (shadows.valid && !lightsChanged && !castersChanged)
+        return;
+
+    // The shadow pass variant only needs the vertex format; it fails once and turns shadows off
+    if (!UUseShaderVariant(SHADER_SHADOW_PASS | (mesh.compactVertices ? SHADER_COMPACT_VERTICES : 0)))
+    {
+        cerr << "ERROR: Shadow pass shader failed to build, shadows are off" << endl;
+        UDestroyShadowMaps(shadows);
+        return;
+    }
+
+    // Bounding spheres of every instance, which the depth ranges must hold so the receivers behind the casters
+    // are compared against them, and of the casters alone
+    glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX), castersMin(FLT_MAX), castersMax(-FLT_MAX);
+    for (size_t i = 0; i < mesh.instances.size(); ++i)
+    {
+        const glm::vec3 center(mesh.cullSpheres.x[i], mesh.cullSpheres.y[i], mesh.cullSpheres.z[i]);
+        sceneMin = glm::min(sceneMin, center - mesh.cullSpheres.radius[i]);
+        sceneMax = glm::max(sceneMax, center + mesh.cullSpheres.radius[i]);
+        if ((SHADOW_CASTER_MATERIALS >> mesh.instances[i].material) & 1)
+        {
+            castersMin = glm::min(castersMin, center - mesh.cullSpheres.radius[i]);
+            castersMax = glm::max(castersMax, center + mesh.cullSpheres.radius[i]);
+        }
+    }
+    const glm::vec3 sceneCenter = (sceneMin + sceneMax) * 0.5f;
+    const float sceneRadius = glm::length(sceneMax - sceneMin) * 0.5f;
+    const glm::vec3 castersCenter = (castersMin + castersMax) * 0.5f;
+    const float castersRadius = glm::length(castersMax - castersMin) * 0.5f;
+
+    // The spotlight's frustum is its cone. The key light shines everywhere, so its frustum is fitted around
+    // the casters instead, as nothing outside them can be in shadow; or around as much of them as a single
+    // map can hold when the light is among them
+    glm::mat4 viewProjections[SHADOW_LAYER_COUNT];
+    const Spotlight& spotlight = gLightBlock.spotlight;
+    viewProjections[SHADOW_LAYER_SPOTLIGHT] = ULightViewProjection(spotlight.position, glm::normalize(spotlight.direction),
+        std::min(acosf(spotlight.outerCutOff) * SHADOW_CONE_MARGIN, SHADOW_MAX_HALF_ANGLE), sceneCenter, sceneRadius);
+    const glm::vec3 toCasters = castersCenter - gLightBlock.keyLight.position;
+    const float castersDistance = glm::length(toCasters);
+    const glm::vec3 keyDirection = castersDistance > 0.0f ? toCasters / castersDistance : glm::vec3(0.0f, -1.0f, 0.0f);
+    const float keyHalfAngle = castersDistance > castersRadius ?
+        std::min(asinf(castersRadius / castersDistance) * SHADOW_CONE_MARGIN, SHADOW_MAX_HALF_ANGLE) : SHADOW_MAX_HALF_ANGLE;
+    viewProjections[SHADOW_LAYER_KEY_LIGHT] = ULightViewProjection(gLightBlock.keyLight.position, keyDirection,
+        keyHalfAngle, sceneCenter, sceneRadius);
+
+    // Depth only, with a slope-scaled bias so lit surfaces do not shadow themselves
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadows.framebuffer);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mesh.shadowIndirectBuffer);
+    for (int layer = 0; layer < SHADOW_LAYER_COUNT; ++layer)
+    {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadows.texture, 0, layer);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUniformMatrix4fv(gUniforms.uShadowViewProjection, 1, GL_FALSE, glm::value_ptr(viewProjections[layer]));
+        glMultiDrawElementsIndirect(GL_TRIANGLES, mesh.indexType, (void*)0, GLsizei(mesh.shadowCommands.size()), 0);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    // The lighting pass looks the maps up in texture space: x, y and depth remapped from [-1, 1] to [0, 1]
+    const glm::mat4 textureSpace = glm::translate(glm::vec3(0.5f)) * glm::scale(glm::vec3(0.5f));
+    gLightBlock.spotShadowMatrix = textureSpace * viewProjections[SHADOW_LAYER_SPOTLIGHT];
+    gLightBlock.keyShadowMatrix = textureSpace * viewProjections[SHADOW_LAYER_KEY_LIGHT];
+    gLightsDirty = true;
+
+    shadows.keyLight = gLightBlock.keyLight;
+    shadows.spotlight = gLightBlock.spotlight;
+    shadows.valid = true;
+    ++shadows.renderCount;
+    cout << "INFO: Shadow maps rendered (" << shadows.renderCount << " so far), "
+         << (shadows.renderCount == 1 ? "first frame" : lightsChanged ? "a light changed" : "a shadow caster moved") << endl;
+}